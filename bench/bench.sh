@@ -0,0 +1,52 @@
+#!/bin/sh
+# Loopback benchmark scenarios for mojweb, run from the top directory with
+# `make bench`. Knobs: PORT, DURATION, CONNS, RATE (open loop scenarios).
+
+PORT=${PORT:-18080}
+DURATION=${DURATION:-10}
+CONNS=${CONNS:-32}
+RATE=${RATE:-10000}
+
+SERVER=./mojweb
+LOADGEN=./bench/loadgen
+
+ROOT=$(mktemp -d) || exit 1
+PID=
+
+cleanup(){
+    [ -n "$PID" ] && kill $PID 2>/dev/null && wait $PID 2>/dev/null
+    rm -rf "$ROOT" "$ROOT.log"
+}
+trap cleanup EXIT INT TERM
+
+# docroot: a small page, a large file and a directory with a few hundred entries
+head -c 4096 /dev/urandom | base64 > "$ROOT/small.html"
+head -c 67108864 /dev/zero > "$ROOT/large.bin"
+mkdir "$ROOT/dir"
+i=0
+while [ $i -lt 300 ]; do
+    echo $i > "$ROOT/dir/file$i.txt"
+    i=$((i + 1))
+done
+
+$SERVER -r "$ROOT" -l 127.0.0.1:$PORT > "$ROOT.log" 2>&1 &
+PID=$!
+sleep 0.5
+kill -0 $PID 2>/dev/null || { echo "mojweb didn't start" >&2; exit 1; }
+
+run(){
+    echo "== $1"
+    shift
+    $LOADGEN -P $PORT -d $DURATION "$@"
+    echo
+}
+
+run "small file, closed loop"           -c $CONNS /small.html
+run "small file, pipelined"             -c $CONNS -p 16 /small.html
+run "small file, no keep-alive"         -c $CONNS -K /small.html
+run "small file, open loop"             -c $CONNS -r $RATE /small.html
+run "large file streaming"              -c 4 /large.bin
+run "directory listing"                 -c $CONNS /dir/
+run "404"                               -c $CONNS /missing.html
+# idle connections hold a thread each, stay under MAX_THREAD
+run "small file, 200 idle connections"  -c $CONNS -i 200 -r $RATE /small.html
@@ -0,0 +1,328 @@
+#define _GNU_SOURCE // ppoll
+#include "../mrepro.h"
+
+#include <time.h>
+#include <stdint.h>
+
+// HTTP load generator for mojweb.
+//
+// Closed loop (default): every connection sends the next request as soon as
+// a response comes back. Open loop (-r rate): requests are scheduled at a
+// fixed rate spread over the connections, latency is measured from the time
+// a request was *supposed* to go out, so a stalled server shows up in the
+// percentiles instead of silently lowering the offered load (coordinated
+// omission).
+
+#define HIST_SUB   32           // sub-buckets per power of two, ~3% precision
+#define HIST_LEN   (48 * HIST_SUB)
+#define MAX_DEPTH  64           // pipelined requests in flight per connection
+#define RESP_LEN   65536
+#define NSEC       1000000000LL
+
+void Usage(const char* name){
+    Errx(MP_PARAM_ERR, "%s [-c conns] [-d secs] [-r rate] [-p depth] [-K] [-i idle_conns] "
+        "[-h host] [-P port] path...", name);
+}
+
+// options
+int num_conns = 10;
+int duration = 10;
+double rate = 0;        // requests per second over all connections, 0 closed loop
+int depth = 1;          // pipelined requests
+int keep_alive = 1;
+int idle_conns = 0;     // connections opened and left alone for the whole run
+char* host = "127.0.0.1";
+char* port = "80";
+char** paths;
+int num_paths;
+
+typedef struct {
+    int id;
+    pthread_t tid;
+    uint64_t hist[HIST_LEN];    // latency in microseconds
+    long requests;
+    long errors;
+    long status[6];             // by first digit
+    long long bytes;
+    long connects;
+} worker;
+
+int64_t Now(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NSEC + ts.tv_nsec;
+}
+
+// HISTOGRAM
+
+int HistIndex(uint64_t v){
+    int e = 0;
+    while ((v >> e) >= 2 * HIST_SUB) e++;
+    if (e == 0) return v;
+    return MIN(e * HIST_SUB + (v >> e), HIST_LEN - 1);
+}
+
+uint64_t HistValue(int i){
+    if (i < 2 * HIST_SUB) return i;
+    return (uint64_t) (i % HIST_SUB + HIST_SUB) << (i / HIST_SUB - 1);
+}
+
+uint64_t Percentile(const uint64_t* hist, uint64_t total, double p){
+    uint64_t seen = 0, want = total * p / 100.0;
+    int i;
+    FOR(i, HIST_LEN){
+        seen += hist[i];
+        if (seen > want || seen == total) return HistValue(i);
+    }
+    return HistValue(HIST_LEN - 1);
+}
+
+// CONNECTION
+
+int Dial(){
+    struct addrinfo hints, *res;
+    int s, on = 1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    Getaddrinfo(host, port, &hints, &res);
+    s = Socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (connect(s, res->ai_addr, res->ai_addrlen)){
+        close(s);
+        s = -1;
+    } else
+        setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    freeaddrinfo(res);
+    return s;
+}
+
+// length of a complete response header in buff, 0 if not there yet
+int HeaderLen(const char* buff, int len, int* status, long long* body, int* chunked){
+    const char* end;
+    const char* h;
+
+    if ( (end = strstr(buff, "\r\n\r\n")) == NULL ) return 0;
+
+    *status = len > 12 ? atoi(buff + 9) : 0;
+    *body = 0;
+    *chunked = 0;
+    for (h = buff; h < end; h++){
+        if (!strncasecmp(h, "\r\nContent-Length:", 17))
+            *body = atoll(h + 17);
+        else if (!strncasecmp(h, "\r\nTransfer-Encoding: chunked", 28))
+            *chunked = 1;
+    }
+    return end + 4 - buff;
+}
+
+// length of the chunk size line at buff, 0 if not there yet; left gets the
+// data and CRLF that follow, 0 after the last chunk (no trailers expected)
+int ChunkLen(const char* buff, int len, long long* left){
+    const char* end;
+    long long size;
+
+    if ( (end = strstr(buff, "\r\n")) == NULL ) return 0;
+    size = strtoll(buff, NULL, 16);
+    if (size > 0){
+        *left = size + 2;
+        return end + 2 - buff;
+    }
+    if (end + 4 > buff + len) return 0;
+    *left = 0;
+    return end + 4 - buff;
+}
+
+void* Run(void* args){
+    worker* w = (worker*) args;
+    char* req = MLC(char, BUFFER_LEN);
+    char* resp = MLC(char, RESP_LEN + 1);
+    int64_t sent_at[MAX_DEPTH];         // fifo of intended send times
+    int head = 0, outstanding = 0;
+    int64_t start = Now(), end = start + duration * NSEC, now, next, wait;
+    int64_t interval = rate > 0 ? (int64_t) (NSEC * num_conns / rate) : 0;
+    int s = -1, len = 0, pos, n, status = 0, req_len, in_body = 0, chunked = 0, k = w->id;
+    long long body_left = 0, take;
+    struct pollfd pfd;
+    struct timespec ts;
+
+    // stagger connections over one interval
+    next = start + (interval ? interval * w->id / num_conns : 0);
+
+    while ( (now = Now()) < end ){
+
+        if (s == -1){
+            if ( (s = Dial()) == -1 ){
+                w->errors++;
+                usleep(1000);
+                continue;
+            }
+            w->connects++;
+            len = outstanding = head = in_body = 0;
+        }
+
+        // send everything that is due
+        while (outstanding < depth && (interval == 0 || next <= now)){
+            req_len = sprintf(req, "GET %s HTTP/1.1\r\nHost: %s\r\n%s\r\n",
+                paths[k++ % num_paths], host, keep_alive ? "" : "Connection: close\r\n");
+            if (Writen(s, req, req_len) < 0) break;
+            sent_at[(head + outstanding++) % MAX_DEPTH] = interval ? next : now;
+            next += interval;
+        }
+
+        pfd.fd = s;
+        pfd.events = POLLIN;
+        // wake up for the next send, ppoll() so short gaps don't spin
+        wait = interval && outstanding < depth ? MAX(next - now, 0) : 100000000;
+        ts.tv_sec = wait / NSEC;
+        ts.tv_nsec = wait % NSEC;
+        if (ppoll(&pfd, 1, &ts, NULL) <= 0)
+            continue;
+
+        if ( (n = read(s, resp + len, RESP_LEN - len)) <= 0 ){
+            w->errors += outstanding + (n < 0);
+            close(s);
+            s = -1;
+            continue;
+        }
+        w->bytes += n;
+        len += n;
+        resp[len] = 0;
+
+        // bodies are skipped as they stream by, only headers are buffered
+        pos = 0;
+        while (outstanding > 0){
+            if (!in_body){
+                if ( (n = HeaderLen(resp + pos, len - pos, &status, &body_left, &chunked)) == 0 )
+                    break;
+                pos += n;
+                in_body = 1;
+            }
+            take = MIN(body_left, len - pos);
+            pos += take;
+            body_left -= take;
+            if (body_left > 0)
+                break;
+            if (chunked){
+                if ( (n = ChunkLen(resp + pos, len - pos, &body_left)) == 0 )
+                    break;
+                pos += n;
+                if (body_left > 0)
+                    continue;
+            }
+
+            now = Now();
+            w->hist[HistIndex((now - sent_at[head]) / 1000)]++;
+            w->requests++;
+            w->status[MIN(status / 100, 5)]++;
+            head = (head + 1) % MAX_DEPTH;
+            outstanding--;
+            in_body = 0;
+
+            if (!keep_alive){
+                close(s);
+                s = -1;
+                break;
+            }
+        }
+
+        memmove(resp, resp + pos, len - pos);
+        len -= pos;
+        resp[len] = 0;
+
+        if (s != -1 && len == RESP_LEN){
+            // header doesn't fit
+            w->errors++;
+            close(s);
+            s = -1;
+        }
+    }
+
+    if (s != -1) close(s);
+    free(req);
+    free(resp);
+    pthread_exit(0);
+}
+
+int main(int argc, char** argv){
+    worker* workers;
+    uint64_t* hist = Calloc(HIST_LEN * sizeof(uint64_t));
+    uint64_t total = 0;
+    long errors = 0, connects = 0, status[6] = {0};
+    long long bytes = 0;
+    int* idle;
+    int i, j;
+    double secs;
+    int64_t start;
+    char ch;
+
+    while ( (ch = getopt(argc, argv, "c:d:h:i:Kp:P:r:")) != -1 ){
+        switch (ch) {
+            case 'c': num_conns = atoi(optarg); break;
+            case 'd': duration = atoi(optarg); break;
+            case 'h': host = optarg; break;
+            case 'i': idle_conns = atoi(optarg); break;
+            case 'K': keep_alive = 0; break;
+            case 'p': depth = atoi(optarg); break;
+            case 'P': port = optarg; break;
+            case 'r': rate = atof(optarg); break;
+            default: Usage(argv[0]);
+        }
+    }
+
+    if (optind == argc || num_conns < 1 || depth < 1 || depth > MAX_DEPTH)
+        Usage(argv[0]);
+    if (!keep_alive) depth = 1;
+    paths = argv + optind;
+    num_paths = argc - optind;
+
+    Signal(SIGPIPE, SIG_IGN);
+
+    idle = MLC(int, (idle_conns + 1));
+    FOR(i, idle_conns){
+        if ( (idle[i] = Dial()) == -1 )
+            Warnx("idle connection %d failed", i);
+    }
+
+    workers = Calloc(num_conns * sizeof(worker));
+    start = Now();
+    FOR(i, num_conns){
+        workers[i].id = i;
+        pthread_create(&workers[i].tid, NULL, Run, workers + i);
+    }
+    FOR(i, num_conns){
+        pthread_join(workers[i].tid, NULL);
+        FOR(j, HIST_LEN) hist[j] += workers[i].hist[j];
+        FOR(j, 6) status[j] += workers[i].status[j];
+        total += workers[i].requests;
+        errors += workers[i].errors;
+        bytes += workers[i].bytes;
+        connects += workers[i].connects;
+    }
+    secs = (Now() - start) / (double) NSEC;
+
+    FOR(i, idle_conns)
+        if (idle[i] != -1) close(idle[i]);
+
+    printf("%s %d conns, depth %d, %s, %s\n", rate > 0 ? "open loop" : "closed loop",
+        num_conns, depth, keep_alive ? "keep-alive" : "close", paths[0]);
+    if (rate > 0)
+        printf("  offered    %.0f req/s\n", rate);
+    printf("  requests   %lu in %.2fs, %.0f req/s, %.2f MB/s\n", (unsigned long) total, secs,
+        total / secs, bytes / secs / 1e6);
+    printf("  status     2xx %ld  3xx %ld  4xx %ld  5xx %ld  errors %ld  connects %ld\n",
+        status[2], status[3], status[4], status[5], errors, connects);
+    printf("  latency us p50 %lu  p90 %lu  p99 %lu  p99.9 %lu  p99.99 %lu  max %lu\n",
+        (unsigned long) Percentile(hist, total, 50),
+        (unsigned long) Percentile(hist, total, 90),
+        (unsigned long) Percentile(hist, total, 99),
+        (unsigned long) Percentile(hist, total, 99.9),
+        (unsigned long) Percentile(hist, total, 99.99),
+        (unsigned long) Percentile(hist, total, 100));
+
+    free(idle);
+    free(workers);
+    free(hist);
+    return errors > 0;
+}
@@ -0,0 +1,189 @@
+// Micro-benchmarks for the request path primitives.
+//
+// Every case runs in a tight loop for a fixed number of iterations after a
+// warm-up, reports wall clock ns/op, cycles/op (TSC where there is one) and
+// heap allocations/op. The server itself is compiled in, main() excluded.
+//
+//   make micro                 build and run everything
+//   bench/micro [iters] [case] one case, e.g. bench/micro 100000 GetType
+
+#define _GNU_SOURCE
+#define MOJWEB_NO_MAIN
+#include "../mojweb.c"
+
+#include <time.h>
+#include <stdint.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define ITERS_DEFAULT 1000000
+#define NSEC          1000000000LL
+
+// ALLOCATION COUNTING
+
+// malloc family is interposed, glibc keeps the real ones under __libc_*
+#ifdef __GLIBC__
+extern void* __libc_malloc(size_t);
+extern void* __libc_calloc(size_t, size_t);
+extern void* __libc_realloc(void*, size_t);
+
+static volatile long allocs = 0;
+
+void* malloc(size_t size){
+    allocs++;
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t n, size_t size){
+    allocs++;
+    return __libc_calloc(n, size);
+}
+
+void* realloc(void* ptr, size_t size){
+    allocs++;
+    return __libc_realloc(ptr, size);
+}
+#define ALLOCS() allocs
+#else
+#define ALLOCS() 0L
+#endif
+
+// CLOCKS
+
+int64_t Now(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NSEC + ts.tv_nsec;
+}
+
+uint64_t Cycles(){
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    uint64_t v;
+    __asm__ volatile("mrs %0, cntvct_el0" : "=r" (v));
+    return v;
+#else
+    return 0;
+#endif
+}
+
+// CASES
+
+typedef void BenchFunc(long);
+
+typedef struct {
+    const char* name;
+    BenchFunc* run;
+} bench;
+
+client bench_client;
+char path_buff[PATH_LEN];
+const char* paths[] = { "/index.html", "/docs/manual/chapter1/index.html",
+    "/img/logo.png", "/src/mojweb.c", "/Makefile", "/no_extension", 0 };
+volatile int sink;
+
+void BenchGetType(long i){
+    sink += GetType(paths[i % 6]) != NULL;
+}
+
+void BenchRemoveIndex(long i){
+    strcpy(path_buff, paths[i % 6]);
+    RemoveIndex(path_buff);
+    sink += path_buff[0];
+}
+
+void BenchPercentDecode(long i){
+    strcpy(path_buff, "/docs/my%20notes/caf%C3%A9.html?lang=hr");
+    sink += PercentDecode(path_buff);
+}
+
+void BenchWriteHeader(long i){
+    WriteHeader(&bench_client, 200, 0, 4096, "text/html");
+}
+
+void BenchWriten(long i){
+    static const char body[] = "<html><body><h1>404 Not Found</h1></body></html>";
+    Writen(bench_client.socket, body, sizeof(body) - 1);
+}
+
+void BenchHttpError(long i){
+    HttpError(&bench_client, 404);
+}
+
+void BenchGetFile(long i){
+    strcpy(path_buff, "/small.html");
+    Get(&bench_client, path_buff);
+}
+
+void BenchGet404(long i){
+    strcpy(path_buff, "/missing.html");
+    Get(&bench_client, path_buff);
+}
+
+bench benches[] = {
+    { "GetType",        BenchGetType        },
+    { "RemoveIndex",    BenchRemoveIndex    },
+    { "PercentDecode",  BenchPercentDecode  },
+    { "WriteHeader",    BenchWriteHeader    },
+    { "Writen",         BenchWriten         },
+    { "HttpError",      BenchHttpError      },
+    { "Get(file)",      BenchGetFile        },
+    { "Get(404)",       BenchGet404         },
+    { 0,                0                   }
+};
+
+void Run(const bench* b, long iters){
+    long i, a;
+    int64_t t;
+    uint64_t cyc;
+
+    FOR(i, iters / 10 + 1)     // warm caches and branch predictors
+        b->run(i);
+
+    a = ALLOCS();
+    t = Now();
+    cyc = Cycles();
+    FOR(i, iters)
+        b->run(i);
+    cyc = Cycles() - cyc;
+    t = Now() - t;
+    a = ALLOCS() - a;
+
+    printf("%-14s %10.1f ns/op %10.1f cycles/op %6.2f allocs/op\n", b->name,
+        (double) t / iters, (double) cyc / iters, (double) a / iters);
+}
+
+int main(int argc, char** argv){
+    long iters = argc > 1 ? atol(argv[1]) : ITERS_DEFAULT;
+    char root[] = "/tmp/microXXXXXX";
+    int i, fd;
+
+    if (iters < 1)
+        Errx(MP_PARAM_ERR, "%s [iters] [case]", argv[0]);
+
+    // docroot with one small file, responses go to /dev/null
+    if (mkdtemp(root) == NULL || chdir(root))
+        Error(root);
+    if ( (fd = open("small.html", O_WRONLY | O_CREAT, 0644)) == -1 )
+        Error("can't make small.html");
+    FOR(i, 64)
+        Writen(fd, "0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcde\n", 64);
+    close(fd);
+
+    if ( (bench_client.socket = open("/dev/null", O_WRONLY)) == -1 )
+        Error("/dev/null");
+    bench_client.ip = "bench";
+    dup2(bench_client.socket, STDERR_FILENO); // Log() output
+
+    for (i = 0; benches[i].name; i++){
+        if (argc > 2 && strcmp(argv[2], benches[i].name))
+            continue;
+        Run(benches + i, iters);
+    }
+
+    unlink("small.html");
+    rmdir(root);
+    return 0;
+}
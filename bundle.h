@@ -0,0 +1,354 @@
+#ifndef BUNDLE_FH
+#define BUNDLE_FH
+
+// Document root packed in one archive.
+//
+// A root can be an uncompressed zip (zip -0 -r site.zip .) instead of a
+// directory. It is mmap()ed whole and its members are indexed by name in
+// a hash table, so serving one is a lookup instead of open() and fstat()
+// on an inode of its own. Small members leave in one writev() straight
+// from the mapping, larger ones with sendfile() from the archive.
+// A directory serves its index.html, there are no listings.
+// Deploys rename() a new archive over the old one. The path is checked at
+// most every BUNDLE_CHECK seconds, a new archive is mapped and indexed by
+// the request that notices it while the others carry on with the old one,
+// which is unmapped after its last response.
+// Only stored members are served, compressed and encrypted ones are
+// skipped with a warning when the archive is loaded. zip64 is understood,
+// so there is no limit of 65535 members or 4G.
+
+#define BUNDLE_CHECK      1       // seconds between looks for a new archive
+#define BUNDLE_WRITEV_MAX 65536   // larger members go out with sendfile()
+
+#define ZIP_EOCD      0x06054b50
+#define ZIP64_EOCD    0x06064b50
+#define ZIP64_LOCATOR 0x07064b50
+#define ZIP_CENTRAL   0x02014b50
+#define ZIP_LOCAL     0x04034b50
+#define ZIP64_EXTRA   0x0001
+
+typedef struct {
+    const char* name;   // in the mapping, not terminated
+    int name_len;
+    off_t offset;       // of the data in the archive
+    off_t size;
+} bundle_entry;
+
+typedef struct bundle {
+    int fd;
+    byte* map;
+    off_t size;
+    bundle_entry* entries;
+    int num_entries;
+    int* index;         // entry numbers, -1 is empty
+    unsigned int mask;
+    int refs;           // responses in flight, +1 while current
+} bundle;
+
+// what a vhost points to, the archive behind it can change
+typedef struct bundle_root {
+    char* path;         // absolute, we chdir() after options
+    pthread_mutex_t lock;
+    bundle* current;
+    time_t checked;
+    struct stat st;     // of current
+} bundle_root;
+
+unsigned int ZipU16(const byte* p){
+    return p[0] | p[1] << 8;
+}
+
+unsigned int ZipU32(const byte* p){
+    return p[0] | p[1] << 8 | p[2] << 16 | (unsigned int) p[3] << 24;
+}
+
+uint64_t ZipU64(const byte* p){
+    return ZipU32(p) | (uint64_t) ZipU32(p + 4) << 32;
+}
+
+// zip64 sizes and offset of the central header at cd, from its extra
+// field; they are there only for the fields that are all ones
+void Zip64Extra(const byte* cd, uint64_t* size, uint64_t* csize, uint64_t* offset){
+    const byte* p = cd + 46 + ZipU16(cd + 28);
+    const byte* end = p + ZipU16(cd + 30);
+    const byte* v;
+
+    for (; p + 4 <= end; p += 4 + ZipU16(p + 2)){
+        if (ZipU16(p) != ZIP64_EXTRA)
+            continue;
+        v = p + 4;
+        if (*size == 0xffffffff && v + 8 <= end)   { *size = ZipU64(v); v += 8; }
+        if (*csize == 0xffffffff && v + 8 <= end)  { *csize = ZipU64(v); v += 8; }
+        if (*offset == 0xffffffff && v + 8 <= end) { *offset = ZipU64(v); }
+        return;
+    }
+}
+
+unsigned int BundleHash(const char* name, int len){
+    unsigned int h = 2166136261u; // FNV-1a
+    while (len-- > 0){
+        h ^= (byte) *name++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+bundle_entry* BundleFind(bundle* b, const char* name, int len){
+    unsigned int i;
+    bundle_entry* e;
+
+    for (i = BundleHash(name, len) & b->mask; b->index[i] != -1; i = (i + 1) & b->mask){
+        e = b->entries + b->index[i];
+        if (e->name_len == len && !memcmp(e->name, name, len))
+            return e;
+    }
+    return NULL;
+}
+
+void BundleFree(bundle* b){
+    munmap(b->map, b->size);
+    close(b->fd);
+    free(b->entries);
+    free(b->index);
+    free(b);
+}
+
+// maps and indexes the archive open on fd (st is its fstat), NULL if it
+// isn't a zip we can serve from
+bundle* BundleLoad(const char* path, int fd, const struct stat* st){
+    bundle* b;
+    const byte* p;
+    const byte* end;
+    const byte* eocd = NULL;
+    const byte* cd;
+    const byte* local;
+    bundle_entry* e;
+    uint64_t i, n, cd_off, cd_size, size, csize, offset;
+    unsigned int h, name_len, skipped = 0;
+
+    if (st->st_size < 22 || !S_ISREG(st->st_mode)){
+        Warnx("%s: not a zip archive", path);
+        return NULL;
+    }
+
+    b = Calloc(sizeof(bundle));
+    b->fd = fd;
+    b->size = st->st_size;
+    if ( (b->map = mmap(NULL, b->size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED ){
+        Warnx("mmap %s: %s", path, strerror(errno));
+        free(b);
+        return NULL;
+    }
+    end = b->map + b->size;
+
+    // end of central directory, behind at most 64k of comment
+    for (p = end - 22; p >= b->map && p >= end - 22 - 65535; p--){
+        if (ZipU32(p) == ZIP_EOCD){
+            eocd = p;
+            break;
+        }
+    }
+    if (eocd != NULL){
+        n = ZipU16(eocd + 10);
+        cd_size = ZipU32(eocd + 12);
+        cd_off = ZipU32(eocd + 16);
+        // zip64 end record, its locator sits right before the plain one
+        if (eocd - 20 >= b->map && ZipU32(eocd - 20) == ZIP64_LOCATOR &&
+            (p = b->map + ZipU64(eocd - 12)) + 56 <= eocd - 20 && ZipU32(p) == ZIP64_EOCD){
+            n = ZipU64(p + 32);
+            cd_size = ZipU64(p + 40);
+            cd_off = ZipU64(p + 48);
+        }
+    }
+    if (eocd == NULL || cd_off > b->size || cd_size > b->size - cd_off || n > cd_size / 46){
+        Warnx("%s: no zip central directory", path);
+        b->fd = -1;
+        BundleFree(b);
+        return NULL;
+    }
+
+    b->entries = MLC(bundle_entry, (n + 1));
+    for (b->mask = 15; b->mask < 2 * n; b->mask = b->mask * 2 + 1);
+    b->index = MLC(int, (b->mask + 1));
+    memset(b->index, -1, (b->mask + 1) * sizeof(int));
+
+    p = b->map + cd_off;
+    FOR(i, n){
+        cd = p;
+        if (cd + 46 > end || ZipU32(cd) != ZIP_CENTRAL)
+            break;
+        name_len = ZipU16(cd + 28);
+        p = cd + 46 + name_len + ZipU16(cd + 30) + ZipU16(cd + 32);
+        if (p > end)
+            break;
+
+        e = b->entries + b->num_entries;
+        e->name = (const char*) cd + 46;
+        e->name_len = name_len;
+        if (name_len == 0 || e->name[name_len - 1] == '/')
+            continue;   // directory
+
+        size = ZipU32(cd + 24);
+        csize = ZipU32(cd + 20);
+        offset = ZipU32(cd + 42);
+        Zip64Extra(cd, &size, &csize, &offset);
+
+        // stored, not encrypted, local header where it says
+        if (ZipU16(cd + 10) != 0 || ZipU16(cd + 8) & 1 || csize != size ||
+            offset > b->size - 30 || ZipU32( (local = b->map + offset) ) != ZIP_LOCAL){
+            skipped++;
+            continue;
+        }
+        e->size = size;
+        e->offset = offset + 30 + ZipU16(local + 26) + ZipU16(local + 28);
+        if (e->offset > b->size || e->size > b->size - e->offset){
+            skipped++;
+            continue;
+        }
+
+        // a later member of the same name replaces the earlier one
+        for (h = BundleHash(e->name, name_len) & b->mask; b->index[h] != -1; h = (h + 1) & b->mask){
+            if (b->entries[b->index[h]].name_len == name_len &&
+                !memcmp(b->entries[b->index[h]].name, e->name, name_len))
+                break;
+        }
+        b->index[h] = b->num_entries++;
+    }
+
+    if (skipped)
+        Warnx("%s: %u compressed, encrypted or broken members skipped", path, skipped);
+    Log("Bundle %s: %d members\n", path, b->num_entries);
+    b->refs = 1;
+    return b;
+}
+
+// the archive at path as it is now, NULL if it can't be used
+bundle* BundleOpenPath(const char* path, struct stat* st){
+    bundle* b;
+    int fd;
+
+    if ( (fd = open(path, O_RDONLY | O_CLOEXEC)) == -1 ){
+        Warnx("%s: %s", path, strerror(errno));
+        return NULL;
+    }
+    fstat(fd, st);
+    if ( (b = BundleLoad(path, fd, st)) == NULL )
+        close(fd);
+    return b;
+}
+
+// -b, and -v roots that are files
+bundle_root* BundleRoot(const char* path){
+    bundle_root* root = Calloc(sizeof(bundle_root));
+
+    if ( (root->path = realpath(path, NULL)) == NULL )
+        Error(path);
+    if ( (root->current = BundleOpenPath(root->path, &root->st)) == NULL )
+        Errx(MP_PARAM_ERR, "can't serve from %s", path);
+    pthread_mutex_init(&root->lock, NULL);
+    root->checked = time(NULL);
+    return root;
+}
+
+void BundleRelease(bundle_root* root, bundle* b){
+    int last;
+
+    pthread_mutex_lock(&root->lock);
+    last = --b->refs == 0;
+    pthread_mutex_unlock(&root->lock);
+    if (last)
+        BundleFree(b);
+}
+
+// current archive, paired with a BundleRelease(); the request that finds a
+// new one at the path maps it, the others don't wait for that
+bundle* BundleAcquire(bundle_root* root){
+    time_t now = time(NULL);
+    struct stat st;
+    bundle* cur;
+    bundle* b;
+    bundle* old;
+    int check;
+
+    pthread_mutex_lock(&root->lock);
+    if ( (check = now - root->checked >= BUNDLE_CHECK) )
+        root->checked = now;
+    cur = root->current;
+    cur->refs++;
+    pthread_mutex_unlock(&root->lock);
+
+    if (!check || stat(root->path, &st) ||
+        (st.st_dev == root->st.st_dev && st.st_ino == root->st.st_ino &&
+         st.st_size == root->st.st_size && st.st_mtim.tv_sec == root->st.st_mtim.tv_sec &&
+         st.st_mtim.tv_nsec == root->st.st_mtim.tv_nsec))
+        return cur;
+
+    // a broken archive is logged once and the one we have stays
+    if ( (b = BundleOpenPath(root->path, &st)) == NULL ){
+        pthread_mutex_lock(&root->lock);
+        root->st = st;
+        pthread_mutex_unlock(&root->lock);
+        return cur;
+    }
+
+    pthread_mutex_lock(&root->lock);
+    old = root->current;
+    root->current = b;
+    root->st = st;
+    b->refs++;      // ours, the one from BundleLoad() is the root's
+    pthread_mutex_unlock(&root->lock);
+    Log("Bundle %s swapped\n", root->path);
+
+    BundleRelease(root, old);
+    BundleRelease(root, cur);
+    return b;
+}
+
+// path is decoded and starts with /, query is for a redirect
+void GetBundle(client* c, bundle_root* root, const char* path, const char* query){
+    bundle* b = BundleAcquire(root);
+    bundle_entry* e = NULL;
+    const char* name = path + 1;
+    int len = strlen(name);
+    char* idx;
+    char* type;
+
+    if (len > 0 && name[len - 1] != '/')
+        e = BundleFind(b, name, len);
+    if (e == NULL){
+        // a directory, with or without the slash
+        idx = MLC(char, (len + 12));
+        sprintf(idx, "%s%sindex.html", name, len == 0 || name[len - 1] == '/' ? "" : "/");
+        e = BundleFind(b, idx, strlen(idx));
+        free(idx);
+        if (e != NULL && len > 0 && name[len - 1] != '/'){
+            BundleRelease(root, b);
+            Redirect(c, path, query);
+            return;
+        }
+        if (e != NULL)
+            name = "index.html";
+    }
+
+    if (e == NULL){
+        HttpError(c, 404);
+        BundleRelease(root, b);
+        return;
+    }
+    PROBE2(open, c->socket, name);
+    TraceMark(&c->trace, TRACE_OPEN);
+
+    if ( (type = GetType(name)) == NULL )
+        type = DEFAULT_TYPE;
+    if (c->head)
+        WriteHeader(c, 200, 0, e->size, type);
+    else if (e->size <= BUNDLE_WRITEV_MAX)
+        WriteResponse(c, 200, 0, e->size, type, b->map + e->offset);
+    else {
+        WriteHeader(c, 200, 0, e->size, type);
+        ClientSendFile(c, b->fd, e->offset, e->size);
+    }
+    BundleRelease(root, b);
+}
+
+#endif // BUNDLE_FH
@@ -0,0 +1,304 @@
+#ifndef CACHE_FH
+#define CACHE_FH
+
+#include <sys/mman.h>
+
+// Mapped file cache.
+//
+// Files up to cache_max bytes are mmap()ed once and shared by every thread
+// serving them, each document root has its own table. An entry is keyed by
+// path and checked against the fstat() of the freshly opened file, a changed
+// inode, size or mtime drops it from the table; the mapping goes away when
+// the last response using it is done.
+// A table holds at most cache_entries files and cache_bytes of them, past
+// that the least recently used ones make room.
+// Only plain connections are answered from a mapping: writev() copies it in
+// the kernel, where a file truncated meanwhile fails the write with EFAULT.
+// TLS and HTTP/2 copy in userspace, which would SIGBUS, so they read it.
+
+#define CACHE_BUCKETS     1024
+
+typedef struct cache_entry {
+    char* path;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    byte* data;
+    int refs;       // responses in flight, +1 while in the table
+    struct file_cache* cache;
+    struct cache_entry* next;
+    struct cache_entry* newer;  // LRU, the table's only
+    struct cache_entry* older;
+} cache_entry;
+
+// a load in progress, see SINGLE FLIGHT
+typedef struct flight {
+    int kind;
+    char* key;
+    int refs;       // leader and the requests waiting on it
+    int landed;
+    int ok;         // the leader got a result
+    char* data;     // which is shared by everyone, freed with the flight
+    size_t len, cap;
+    struct flight* next;
+} flight;
+
+#define FLIGHT_MAP     0 // key is a path, result goes in the table
+#define FLIGHT_LISTING 1 // key is a request path, result is in data
+
+// one per document root, paths are relative to it
+typedef struct file_cache {
+    cache_entry* table[CACHE_BUCKETS];
+    int entries;
+    size_t bytes;
+    cache_entry* newest;
+    cache_entry* oldest;
+    flight* flights;
+    pthread_mutex_t lock;
+    pthread_cond_t landed;
+} file_cache;
+
+void CacheInit(file_cache* fc){
+    memset(fc->table, 0, sizeof(fc->table));
+    fc->entries = 0;
+    fc->bytes = 0;
+    fc->newest = fc->oldest = NULL;
+    fc->flights = NULL;
+    pthread_mutex_init(&fc->lock, NULL);
+    pthread_cond_init(&fc->landed, NULL);
+}
+
+// SINGLE FLIGHT
+//
+// Concurrent misses for the same thing wait for the first of them, the
+// leader, to load it and take its result instead of loading it again. A
+// flight only lives while it loads and its result is being sent; a request
+// that comes after it landed starts a new one, so no one gets anything
+// older than what racing the leader would have given them.
+
+// joins the flight for kind and key, starting one if there is none; the
+// leader (*leader set) does the work and calls FlightLand(), the others
+// return once it has. Every join is paired with a FlightLeave().
+flight* FlightJoin(file_cache* fc, int kind, const char* key, int* leader){
+    flight* f;
+
+    pthread_mutex_lock(&fc->lock);
+    for (f = fc->flights; f != NULL; f = f->next)
+        if (f->kind == kind && !strcmp(f->key, key))
+            break;
+    if ( (*leader = f == NULL) ){
+        f = Calloc(sizeof(flight));
+        f->kind = kind;
+        f->key = strdup(key);
+        f->next = fc->flights;
+        fc->flights = f;
+    }
+    f->refs++;
+    while (!*leader && !f->landed)
+        pthread_cond_wait(&fc->landed, &fc->lock);
+    pthread_mutex_unlock(&fc->lock);
+    return f;
+}
+
+// leader only, after data and ok are set
+void FlightLand(file_cache* fc, flight* f){
+    flight** pf;
+
+    pthread_mutex_lock(&fc->lock);
+    for (pf = &fc->flights; *pf != f; pf = &(*pf)->next);
+    *pf = f->next;
+    f->landed = 1;
+    pthread_cond_broadcast(&fc->landed);
+    pthread_mutex_unlock(&fc->lock);
+}
+
+void FlightLeave(file_cache* fc, flight* f){
+    int last;
+
+    pthread_mutex_lock(&fc->lock);
+    last = --f->refs == 0;
+    pthread_mutex_unlock(&fc->lock);
+    if (last){
+        free(f->key);
+        free(f->data);
+        free(f);
+    }
+}
+
+// leader only, appends to the shared result
+void FlightAppend(flight* f, const void* data, size_t len){
+    if (f->len + len > f->cap){
+        f->cap = MAX(f->cap * 2, f->len + len);
+        f->data = Realloc(f->data, f->cap);
+    }
+    memcpy(f->data + f->len, data, len);
+    f->len += len;
+}
+
+unsigned int CacheHash(const char* path){
+    unsigned int h = 2166136261u; // FNV-1a
+    while (*path){
+        h ^= (byte) *path++;
+        h *= 16777619u;
+    }
+    return h % CACHE_BUCKETS;
+}
+
+int CacheFresh(const cache_entry* e, const struct stat* st){
+    return e->dev == st->st_dev && e->ino == st->st_ino && e->size == st->st_size &&
+        e->mtime.tv_sec == st->st_mtim.tv_sec && e->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+// cache lock held
+void CacheDropLocked(cache_entry* e){
+    if (--e->refs > 0)
+        return;
+    munmap(e->data, e->size);
+    free(e->path);
+    free(e);
+}
+
+void CacheRelease(cache_entry* e){
+    file_cache* fc = e->cache;
+    pthread_mutex_lock(&fc->lock);
+    CacheDropLocked(e);
+    pthread_mutex_unlock(&fc->lock);
+}
+
+// cache lock held, e goes to the newest end
+void CacheUseLocked(file_cache* fc, cache_entry* e){
+    if (fc->newest == e)
+        return;
+    if (e->older != NULL) e->older->newer = e->newer;
+    if (e->newer != NULL) e->newer->older = e->older;
+    if (fc->oldest == e) fc->oldest = e->newer;
+    e->older = fc->newest;
+    e->newer = NULL;
+    if (fc->newest != NULL) fc->newest->newer = e;
+    fc->newest = e;
+    if (fc->oldest == NULL) fc->oldest = e;
+}
+
+// cache lock held, pe points at e in its bucket; out of the table, and gone
+// once no response uses it
+void CacheUnlinkLocked(file_cache* fc, cache_entry** pe){
+    cache_entry* e = *pe;
+
+    *pe = e->next;
+    if (e->older != NULL) e->older->newer = e->newer;
+    else fc->oldest = e->newer;
+    if (e->newer != NULL) e->newer->older = e->older;
+    else fc->newest = e->older;
+    fc->entries--;
+    fc->bytes -= e->size;
+    CacheDropLocked(e);
+}
+
+// cache lock held, drops the least recently used files until size more fits
+void CacheEvictLocked(file_cache* fc, size_t size){
+    cache_entry** pe;
+    config* cf = Conf();
+
+    while ( fc->oldest != NULL &&
+            (fc->entries >= cf->cache_entries || fc->bytes + size > cf->cache_bytes) ){
+        for (pe = fc->table + CacheHash(fc->oldest->path); *pe != fc->oldest; pe = &(*pe)->next);
+        CacheUnlinkLocked(fc, pe);
+    }
+}
+
+// cache lock held, returns the entry for path, stale ones are unlinked
+cache_entry* CacheFindLocked(file_cache* fc, unsigned int h, const char* path, const struct stat* st){
+    cache_entry** pe;
+    cache_entry* e;
+
+    for (pe = fc->table + h; (e = *pe) != NULL; pe = &e->next){
+        if (strcmp(e->path, path))
+            continue;
+        if (CacheFresh(e, st)){
+            CacheUseLocked(fc, e);
+            return e;
+        }
+        CacheUnlinkLocked(fc, pe);
+        return NULL;
+    }
+    return NULL;
+}
+
+// mapping of the open file fd (st is its fstat), NULL if it can't be cached;
+// every hit is paired with a CacheRelease()
+cache_entry* CacheGet(file_cache* fc, const char* path, int fd, const struct stat* st){
+    unsigned int h = CacheHash(path);
+    cache_entry* e;
+    cache_entry* found;
+    flight* f;
+    void* data;
+    int leader;
+
+    if (st->st_size <= 0 || st->st_size > Conf()->cache_max || !S_ISREG(st->st_mode))
+        return NULL;
+
+    pthread_mutex_lock(&fc->lock);
+    if ( (e = CacheFindLocked(fc, h, path, st)) != NULL ){
+        e->refs++;
+        pthread_mutex_unlock(&fc->lock);
+        return e;
+    }
+    pthread_mutex_unlock(&fc->lock);
+
+    // one miss maps the file, the ones that come meanwhile take its entry;
+    // if it didn't make the table they go without the cache
+    f = FlightJoin(fc, FLIGHT_MAP, path, &leader);
+    if (!leader){
+        pthread_mutex_lock(&fc->lock);
+        if ( (e = CacheFindLocked(fc, h, path, st)) != NULL )
+            e->refs++;
+        pthread_mutex_unlock(&fc->lock);
+        FlightLeave(fc, f);
+        return e;
+    }
+
+    // map without the lock, a new version of the file may race us to it
+    data = mmap(NULL, st->st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED){
+        Warnx("mmap %s: %s", path, strerror(errno));
+        FlightLand(fc, f);
+        FlightLeave(fc, f);
+        return NULL;
+    }
+    madvise(data, st->st_size, MADV_SEQUENTIAL);
+    madvise(data, st->st_size, MADV_WILLNEED);
+
+    e = MLC(cache_entry, 1);
+    e->path = strdup(path);
+    e->dev = st->st_dev;
+    e->ino = st->st_ino;
+    e->size = st->st_size;
+    e->mtime = st->st_mtim;
+    e->data = data;
+    e->refs = 1;    // ours
+    e->cache = fc;
+    e->newer = e->older = NULL;
+
+    pthread_mutex_lock(&fc->lock);
+    if ( (found = CacheFindLocked(fc, h, path, st)) != NULL ){
+        found->refs++;
+        CacheDropLocked(e);
+        e = found;
+    } else if (Conf()->cache_entries > 0 && e->size <= Conf()->cache_bytes){
+        CacheEvictLocked(fc, e->size);
+        e->refs++;  // table's
+        e->next = fc->table[h];
+        fc->table[h] = e;
+        fc->entries++;
+        fc->bytes += e->size;
+        CacheUseLocked(fc, e);
+    }
+    pthread_mutex_unlock(&fc->lock);
+
+    FlightLand(fc, f);
+    FlightLeave(fc, f);
+    return e;
+}
+
+#endif // CACHE_FH
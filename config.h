@@ -0,0 +1,309 @@
+#ifndef CONFIG_FH
+#define CONFIG_FH
+
+#include <stddef.h>
+
+// Configuration file.
+//
+// -f file holds what the options set and some that have none, one
+// "name value" per line, # comments:
+//
+//   listen tls:[::]:443        more listeners, like -l
+//   max_clients 256            connections at once, at most MAX_THREAD
+//   warm_threads 8             threads reading the -w manifest
+//   timeout 300                socket send and receive, seconds
+//   keepalive 300              idle wait for the next request, seconds
+//   sndbuf 262144              and the other -o socket options
+//   cache_max 1048576          -m, largest file in the mmap cache
+//   cache_entries 4096         files in it per document root
+//   cache_bytes 268435456      and their bytes
+//   max_upload 0               -u
+//   stream_min 16777216        files sent as one-off downloads, 0 is never
+//   type wasm application/wasm extension to MIME type, before the table
+//
+// Values in the file win over the options. SIGHUP reads it again into a
+// new snapshot and swaps that in whole; a file with errors is logged and
+// the running configuration stays.
+// Snapshots don't change once published, so readers take no lock. A
+// thread pins the current one with Conf(), announcing it in its reader
+// slot, and keeps seeing it until ConfPut(); client threads do that per
+// request, requests in flight finish on the snapshot they started with.
+// A swapped out snapshot is freed by main once no slot has it.
+// New values apply from the next request or connection on. listen,
+// backlog and warm_threads are only read at start; a hot restart (SIGUSR2)
+// reads the file again but keeps the listeners it is handed.
+
+#define CACHE_MAX     (1 << 20)
+#define CACHE_ENTRIES 4096  // past these the least recently used files go
+#define CACHE_BYTES   (256 << 20)
+#define WARM_THREADS  8
+#define STREAM_MIN    (16 << 20)
+
+typedef struct {
+    char* ext;
+    char* type;
+} mime_type;
+
+typedef struct config {
+    sock_opts sock;         // -o
+    int max_clients;
+    int warm_threads;
+    int timeout;
+    int keepalive;
+    size_t cache_max;       // -m, 0 disables the mmap cache
+    int cache_entries;
+    size_t cache_bytes;
+    off_t max_upload;       // -u, uploads are refused without it
+    size_t stream_min;      // see STREAMING
+    char* listen[MAX_LISTEN];
+    int num_listen;
+    mime_type* types;       // from the file, looked up first
+    int num_types;
+    struct config* retired; // next one waiting to be freed
+} config;
+
+// a thread that reads the configuration
+typedef struct conf_reader {
+    config* pinned;         // NULL between requests
+    struct conf_reader* next;
+} conf_reader;
+
+#define CONF_INT  0
+#define CONF_SIZE 1
+#define CONF_OFF  2
+
+struct {
+    char* name;
+    size_t offset;
+    int kind;
+} conf_names [] = {
+    { "max_clients",    offsetof(config, max_clients),   CONF_INT  },
+    { "warm_threads",   offsetof(config, warm_threads),  CONF_INT  },
+    { "timeout",        offsetof(config, timeout),       CONF_INT  },
+    { "keepalive",      offsetof(config, keepalive),     CONF_INT  },
+    { "cache_max",      offsetof(config, cache_max),     CONF_SIZE },
+    { "cache_entries",  offsetof(config, cache_entries), CONF_INT  },
+    { "cache_bytes",    offsetof(config, cache_bytes),   CONF_SIZE },
+    { "max_upload",     offsetof(config, max_upload),    CONF_OFF  },
+    { "stream_min",     offsetof(config, stream_min),    CONF_SIZE },
+    { 0,                0,                               0         }
+};
+
+// the options, the file goes over a copy of it
+config conf_boot = { .max_clients = MAX_THREAD, .warm_threads = WARM_THREADS,
+    .timeout = WAIT_SECS, .keepalive = WAIT_SECS, .cache_max = CACHE_MAX,
+    .cache_entries = CACHE_ENTRIES, .cache_bytes = CACHE_BYTES, .stream_min = STREAM_MIN };
+config* conf = &conf_boot;      // current, only main stores it
+config* conf_retired = NULL;    // main's
+conf_reader* conf_readers = NULL;
+pthread_mutex_t conf_lock = PTHREAD_MUTEX_INITIALIZER; // conf_readers
+pthread_key_t conf_key;
+pthread_once_t conf_once = PTHREAD_ONCE_INIT;
+__thread conf_reader* conf_slot;
+
+// thread exit
+void ConfLeave(void* arg){
+    conf_reader* r = arg;
+    conf_reader** pr;
+
+    pthread_mutex_lock(&conf_lock);
+    for (pr = &conf_readers; *pr != r; pr = &(*pr)->next);
+    *pr = r->next;
+    pthread_mutex_unlock(&conf_lock);
+    free(r);
+}
+
+void ConfKey(){
+    pthread_key_create(&conf_key, ConfLeave);
+}
+
+// the snapshot this thread has pinned, the current one if none
+config* Conf(){
+    conf_reader* r = conf_slot;
+    config* cf;
+
+    if (r == NULL){
+        r = Calloc(sizeof(conf_reader));
+        pthread_once(&conf_once, ConfKey);
+        pthread_setspecific(conf_key, r);
+        pthread_mutex_lock(&conf_lock);
+        r->next = conf_readers;
+        conf_readers = r;
+        pthread_mutex_unlock(&conf_lock);
+        conf_slot = r;
+    }
+    if (r->pinned != NULL)
+        return r->pinned;
+
+    // announced, and still current: main either sees it or swapped before
+    do {
+        cf = __atomic_load_n(&conf, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&r->pinned, cf, __ATOMIC_SEQ_CST);
+    } while (cf != __atomic_load_n(&conf, __ATOMIC_SEQ_CST));
+    return cf;
+}
+
+void ConfPut(){
+    if (conf_slot != NULL)
+        __atomic_store_n(&conf_slot->pinned, NULL, __ATOMIC_RELEASE);
+}
+
+void ConfFree(config* cf){
+    int i;
+
+    FOR(i, cf->num_listen)
+        free(cf->listen[i]);
+    FOR(i, cf->num_types){
+        free(cf->types[i].ext);
+        free(cf->types[i].type);
+    }
+    free(cf->types);
+    free(cf);
+}
+
+// one line, 0 if it makes no sense
+int ConfSet(config* cf, char* name, char* value, char** save){
+    mime_type* t;
+    char* type;
+    long long n;
+    int i;
+
+    if (!strcmp(name, "listen")){
+        if (cf->num_listen == MAX_LISTEN)
+            return 0;
+        cf->listen[cf->num_listen++] = strdup(value);
+        return 1;
+    }
+    if (!strcmp(name, "type")){
+        if ( (type = strtok_r(NULL, " \t", save)) == NULL )
+            return 0;
+        cf->types = Realloc(cf->types, (cf->num_types + 1) * sizeof(mime_type));
+        t = cf->types + cf->num_types++;
+        t->ext = strdup(value[0] == '.' ? value + 1 : value);
+        t->type = strdup(type);
+        return 1;
+    }
+
+    // whole numbers, none of them negative: "30s" or "-1" is an error
+    for ( i = 0; conf_names[i].name; i++ ){
+        if (strcmp(name, conf_names[i].name))
+            continue;
+        if (!ParseNumber(value, conf_names[i].kind == CONF_INT ? INT_MAX : LLONG_MAX, &n))
+            return 0;
+        switch (conf_names[i].kind){
+            case CONF_INT:
+                *(int*) ((byte*) cf + conf_names[i].offset) = n;
+                break;
+            case CONF_SIZE:
+                *(size_t*) ((byte*) cf + conf_names[i].offset) = n;
+                break;
+            case CONF_OFF:
+                *(off_t*) ((byte*) cf + conf_names[i].offset) = n;
+                break;
+        }
+        return 1;
+    }
+
+    return SockOptSet(&cf->sock, name, strlen(name), value) == 1;
+}
+
+// the options with path over them, NULL if it can't be read or has errors
+config* ConfLoad(const char* path){
+    FILE* file;
+    char line[PATH_LEN * 4];
+    char* name;
+    char* value;
+    char* save;
+    config* cf;
+    int n = 0, errors = 0;
+
+    if ( (file = fopen(path, "r")) == NULL ){
+        Warnx("%s: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    cf = Malloc(sizeof(config));
+    *cf = conf_boot;
+    cf->num_listen = 0;
+    cf->types = NULL;
+    cf->num_types = 0;
+    cf->retired = NULL;
+
+    while (fgets(line, sizeof(line), file) != NULL){
+        n++;
+        line[strcspn(line, "#\r\n")] = 0;
+        if ( (name = strtok_r(line, " \t", &save)) == NULL )
+            continue;
+        if ( (value = strtok_r(NULL, " \t", &save)) == NULL ||
+             !ConfSet(cf, name, value, &save) || strtok_r(NULL, " \t", &save) != NULL ){
+            Warnx("%s:%d: bad line %s", path, n, name);
+            errors++;
+        }
+    }
+    fclose(file);
+
+    if (cf->max_clients < 1 || cf->max_clients > MAX_THREAD){
+        Warnx("%s: max_clients %d, has to be 1 to %d", path, cf->max_clients, MAX_THREAD);
+        errors++;
+    }
+    if (cf->warm_threads < 1 || cf->timeout < 1 || cf->keepalive < 1){
+        Warnx("%s: warm_threads, timeout and keepalive have to be positive", path);
+        errors++;
+    }
+    if (errors){
+        ConfFree(cf);
+        return NULL;
+    }
+    return cf;
+}
+
+// main, frees the retired snapshots no thread has pinned
+void ConfReclaim(){
+    config** pc = &conf_retired;
+    config* cf;
+    conf_reader* r;
+
+    if (conf_retired == NULL)
+        return;
+    pthread_mutex_lock(&conf_lock);
+    while ( (cf = *pc) != NULL ){
+        for (r = conf_readers; r != NULL && __atomic_load_n(&r->pinned, __ATOMIC_SEQ_CST) != cf; r = r->next);
+        if (r == NULL){
+            *pc = cf->retired;
+            ConfFree(cf);
+        } else
+            pc = &cf->retired;
+    }
+    pthread_mutex_unlock(&conf_lock);
+}
+
+// main, cf becomes current
+void ConfSwap(config* cf){
+    config* old = conf;
+
+    __atomic_store_n(&conf, cf, __ATOMIC_SEQ_CST);
+    sockopts = cf->sock;
+    if (old != &conf_boot){
+        old->retired = conf_retired;
+        conf_retired = old;
+    }
+    ConfReclaim();
+}
+
+// SIGHUP
+void ConfReload(const char* path){
+    config* cf;
+
+    if (path == NULL){
+        Warnx("no -f configuration file to reload");
+        return;
+    }
+    if ( (cf = ConfLoad(path)) == NULL ){
+        Warnx("%s: keeping the running configuration", path);
+        return;
+    }
+    ConfSwap(cf);
+    Log("Configuration %s reloaded\n", path);
+}
+
+#endif // CONFIG_FH
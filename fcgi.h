@@ -0,0 +1,557 @@
+#ifndef FCGI_FH
+#define FCGI_FH
+
+// FastCGI.
+//
+// -F route=addr hands requests to FastCGI workers listening on addr,
+// host:port or unix:path. A route is a path prefix, /app, or an extension,
+// *.php, that matches a path segment ending in it: /a/b.php/more runs
+// /a/b.php with PATH_INFO /more. Prefixes are tried longest first, then
+// extensions in the order given; paths are matched decoded, so an escaped
+// dot doesn't get a script served as a file.
+// Worker connections are kept open (FCGI_KEEP_CONN) in the same pools as
+// proxy upstreams: a request takes an idle one, or connects, and gives it
+// back after FCGI_END_REQUEST. Workers like php-fpm serve one request per
+// connection at a time, so requests run side by side on pooled
+// connections rather than multiplexed on one.
+// Request bodies need a Content-Length and are streamed as FCGI_STDIN.
+// The response is streamed back as it comes, with its Content-Length if the
+// script gave one, chunked otherwise; FCGI_STDERR goes to the log.
+
+#define FCGI_VERSION        1
+#define FCGI_BEGIN_REQUEST  1
+#define FCGI_END_REQUEST    3
+#define FCGI_PARAMS         4
+#define FCGI_STDIN          5
+#define FCGI_STDOUT         6
+#define FCGI_STDERR         7
+#define FCGI_RESPONDER      1
+#define FCGI_KEEP_CONN      1
+#define FCGI_ID             1       // one request at a time on a connection
+#define FCGI_RECORD_MAX     65535
+#define FCGI_HEAD_MAX       ((BUFFER_LEN - BUFFER_LEN_SMALL) / 2) // LF lines grow a CR on the way out
+
+typedef struct fcgi_route {
+    char* match;    // prefix, or extension with its dot
+    size_t len;
+    int ext;
+    upstream* up;
+    struct fcgi_route* next;    // longer prefixes first, extensions last
+} fcgi_route;
+
+// name-value pairs of FCGI_PARAMS
+typedef struct {
+    byte* data;
+    int len, cap;
+} fcgi_params;
+
+// FCGI_STDOUT of a response, record by record
+typedef struct {
+    int s;
+    int left;       // content of the current record not read yet
+    int pad;
+    int ended;      // FCGI_END_REQUEST came
+} fcgi_reader;
+
+fcgi_route* fcgi_routes = NULL;
+
+// route=host:port, route is /prefix or *.ext
+void FcgiAdd(const char* spec){
+    const char* eq = strchr(spec, '=');
+    fcgi_route* fr;
+    fcgi_route** pp;
+    upstream* up;
+
+    if (eq == NULL || eq - spec < 2 || (up = UpstreamFind(eq + 1)) == NULL ||
+        (spec[0] != '/' && strncmp(spec, "*.", 2)))
+        Errx(MP_PARAM_ERR, "fastcgi %s is not /prefix=host:port or *.ext=host:port", spec);
+
+    fr = Calloc(sizeof(fcgi_route));
+    fr->ext = spec[0] == '*';
+    fr->match = strndup(spec + fr->ext, eq - spec - fr->ext);
+    fr->len = strlen(fr->match);
+    fr->up = up;
+
+    for (pp = &fcgi_routes; *pp != NULL && !(*pp)->ext && (fr->ext || (*pp)->len >= fr->len);
+         pp = &(*pp)->next);
+    fr->next = *pp;
+    *pp = fr;
+}
+
+// where the script ends in the decoded path, -1 if fr doesn't take it
+int FcgiMatch(fcgi_route* fr, const char* path){
+    const char* p;
+
+    if (!fr->ext)
+        return strncmp(path, fr->match, fr->len) ? -1 : fr->len;
+    for (p = strstr(path, fr->match); p != NULL; p = strstr(p + 1, fr->match)){
+        if (p > path && p[-1] != '/' && (p[fr->len] == 0 || p[fr->len] == '/'))
+            return p + fr->len - path;
+    }
+    return -1;
+}
+
+// path decoded without the query, NULL if it doesn't decode or has . or
+// .. segments: workers run whatever SCRIPT_FILENAME names, root or not
+char* FcgiDecode(const char* path){
+    char* decoded = strdup(path);
+    char* p;
+    int bad = decoded[0] != '/' || PercentDecode(decoded);
+
+    for (p = decoded; !bad && (p = strstr(p, "/.")) != NULL; p++)
+        bad = p[2] == '/' || p[2] == 0 || (p[2] == '.' && (p[3] == '/' || p[3] == 0));
+    if (bad){
+        free(decoded);
+        return NULL;
+    }
+    return decoded;
+}
+
+// the route of path; dot segments still match, so Fcgi() refuses them
+// instead of the static handler serving /./index.php as source
+fcgi_route* FcgiFind(const char* path){
+    char* decoded;
+    fcgi_route* fr;
+
+    if (fcgi_routes == NULL || path[0] != '/')
+        return NULL;
+    decoded = strdup(path);
+    fr = NULL;
+    if (!PercentDecode(decoded))
+        for (fr = fcgi_routes; fr != NULL && FcgiMatch(fr, decoded) < 0; fr = fr->next);
+    free(decoded);
+    return fr;
+}
+
+// REQUEST
+
+void FcgiParam(fcgi_params* p, const char* name, int name_len, const char* value, int value_len){
+    int i, lens[2] = { name_len, value_len };
+
+    if (p->len + name_len + value_len + 8 > p->cap){
+        p->cap = MAX(p->cap * 2, p->len + name_len + value_len + 8);
+        p->data = Realloc(p->data, p->cap);
+    }
+    // lengths past 127 take four bytes, high bit set
+    FOR(i, 2){
+        if (lens[i] < 128)
+            p->data[p->len++] = lens[i];
+        else {
+            p->data[p->len++] = (lens[i] >> 24) | 0x80;
+            p->data[p->len++] = lens[i] >> 16;
+            p->data[p->len++] = lens[i] >> 8;
+            p->data[p->len++] = lens[i];
+        }
+    }
+    memcpy(p->data + p->len, name, name_len);
+    memcpy(p->data + p->len + name_len, value, value_len);
+    p->len += name_len + value_len;
+}
+
+void FcgiParamString(fcgi_params* p, const char* name, const char* value){
+    FcgiParam(p, name, strlen(name), value, strlen(value));
+}
+
+// request headers as HTTP_ params, the hop by hop ones left out
+void FcgiParamHeaders(fcgi_params* p, const char* request, const char* end){
+    const char* line = strstr(request, "\r\n");
+    const char* next;
+    const char* colon;
+    char name[BUFFER_LEN_SMALL];
+    int i, len;
+
+    for (; line != NULL && line < end; line = next){
+        line += 2;
+        next = strstr(line, "\r\n");
+        if ( (colon = memchr(line, ':', next - line)) == NULL || ProxySkip(line) )
+            continue;
+        len = colon - line;
+        if (len + 6 > sizeof(name) || (len == 14 && !strncasecmp(line, "Content-Length", 14)) ||
+            (len == 12 && !strncasecmp(line, "Content-Type", 12)))
+            continue;   // those two go without HTTP_
+        strcpy(name, "HTTP_");
+        FOR(i, len)
+            name[5 + i] = line[i] == '-' ? '_' : toupper((byte) line[i]);
+        for (colon++; colon < next && (*colon == ' ' || *colon == '\t'); colon++);
+        FcgiParam(p, name, 5 + len, colon, next - colon);
+    }
+}
+
+// CGI/1.1 environment of the request, request NULL if there is no head
+void FcgiParams(fcgi_params* p, client* c, fcgi_route* fr, const char* method, const char* path,
+    const char* decoded, const char* request, const char* end, long long size){
+
+    vhost* v = VhostFind(c->host);
+    const char* query = strchr(path, '?');
+    char* type = request != NULL ? HeaderValue(request, "Content-Type") : NULL;
+    char* file;
+    char host[PATH_LEN];
+    char number[32];
+    int split = FcgiMatch(fr, decoded);
+
+    // prefixes are mounted apps, their own paths start after the prefix
+    if (!fr->ext && split > 0 && decoded[split - 1] == '/')
+        split--;
+
+    FcgiParamString(p, "GATEWAY_INTERFACE", "CGI/1.1");
+    FcgiParamString(p, "SERVER_SOFTWARE", "mojweb");
+    FcgiParamString(p, "SERVER_PROTOCOL", c->stream != NULL ? "HTTP/2" : "HTTP/1.1");
+    FcgiParamString(p, "REQUEST_METHOD", method);
+    FcgiParamString(p, "REQUEST_URI", path);
+    FcgiParamString(p, "QUERY_STRING", query != NULL ? query + 1 : "");
+    FcgiParam(p, "SCRIPT_NAME", 11, decoded, split);
+    FcgiParamString(p, "PATH_INFO", decoded + split);
+    if (v->path != NULL){
+        FcgiParamString(p, "DOCUMENT_ROOT", v->path);
+        file = MLC(char, strlen(v->path) + split + 1);
+        sprintf(file, "%s%.*s", v->path, split, decoded);
+        FcgiParamString(p, "SCRIPT_FILENAME", file);
+        free(file);
+    }
+    FcgiParamString(p, "REMOTE_ADDR", c->ip);
+    HostKey(c->host != NULL ? c->host : "", host, sizeof(host));
+    FcgiParamString(p, "SERVER_NAME", host);
+    if (c->ssl != NULL)
+        FcgiParamString(p, "HTTPS", "on");
+    if (size > 0){
+        sprintf(number, "%lld", size);
+        FcgiParamString(p, "CONTENT_LENGTH", number);
+    }
+    if (type != NULL)
+        FcgiParamString(p, "CONTENT_TYPE", type);
+    if (request != NULL)
+        FcgiParamHeaders(p, request, end);
+    else if (c->host != NULL)
+        FcgiParamString(p, "HTTP_HOST", c->host);
+    free(type);
+}
+
+// one record, content of up to FCGI_RECORD_MAX
+int FcgiRecord(int s, int type, const void* data, int len){
+    byte head[8] = { FCGI_VERSION, type, 0, FCGI_ID, len >> 8, len, 0, 0 };
+    struct iovec iov[2] = { { head, 8 }, { (void*) data, len } };
+    return Writevn(s, iov, len > 0 ? 2 : 1) < 0 ? -1 : 0;
+}
+
+// FCGI_BEGIN_REQUEST and the params, 0 when it all went out
+int FcgiBegin(int s, const fcgi_params* p){
+    byte begin[8] = { 0, FCGI_RESPONDER, FCGI_KEEP_CONN, 0, 0, 0, 0, 0 };
+    int off, n;
+
+    if (FcgiRecord(s, FCGI_BEGIN_REQUEST, begin, 8))
+        return -1;
+    for (off = 0; off < p->len; off += n){
+        n = MIN(p->len - off, FCGI_RECORD_MAX);
+        if (FcgiRecord(s, FCGI_PARAMS, p->data + off, n))
+            return -1;
+    }
+    return FcgiRecord(s, FCGI_PARAMS, NULL, 0);
+}
+
+// count body bytes as FCGI_STDIN, then its end; 0 when they all made it
+int FcgiStdin(body_reader* q, int s, long long count){
+    int n;
+
+    while (count > 0){
+        if (q->pos == q->len){
+            if ( (q->len = BodyFill(q)) <= 0 )
+                return -1;
+            q->pos = 0;
+        }
+        n = MIN(count, q->len - q->pos);
+        if (FcgiRecord(s, FCGI_STDIN, q->buff + q->pos, n))
+            return -1;
+        q->pos += n;
+        count -= n;
+    }
+    return FcgiRecord(s, FCGI_STDIN, NULL, 0);
+}
+
+// RESPONSE
+
+// len bytes of the worker thrown away, into the log if they are stderr
+int FcgiSkip(int s, int len, int log){
+    char buff[BUFFER_LEN_SMALL];
+    int n;
+
+    while (len > 0){
+        n = MIN(len, sizeof(buff));
+        if (Readn(s, buff, n) != n)
+            return -1;
+        if (log)
+            Warnx("fastcgi: %.*s", n - (buff[n - 1] == '\n'), buff);
+        len -= n;
+    }
+    return 0;
+}
+
+// next bytes of FCGI_STDOUT into buff, 0 once the request ended, -1 on
+// errors or a worker that went away
+int FcgiRead(fcgi_reader* fr, char* buff, int cap){
+    byte head[8];
+    int n;
+
+    while (fr->left == 0){
+        if (fr->ended || FcgiSkip(fr->s, fr->pad, 0) || Readn(fr->s, head, 8) != 8 ||
+            head[0] != FCGI_VERSION)
+            return fr->ended ? 0 : -1;
+        fr->left = head[4] << 8 | head[5];
+        fr->pad = head[6];
+        if (head[1] == FCGI_STDOUT)
+            continue;
+        if (FcgiSkip(fr->s, fr->left, head[1] == FCGI_STDERR))
+            return -1;
+        fr->left = 0;
+        if (head[1] == FCGI_END_REQUEST){
+            fr->ended = 1;
+            return FcgiSkip(fr->s, fr->pad, 0) ? -1 : 0;
+        }
+    }
+    if ( (n = Recv(fr->s, buff, MIN(cap, fr->left), 0)) <= 0 )
+        return -1;
+    fr->left -= n;
+    return n;
+}
+
+// the script's header block into r, NUL terminated, with r->pos past it;
+// its length, -1 if there is none
+int FcgiReadHead(fcgi_reader* fr, body_reader* r){
+    char* end;
+    int n;
+
+    r->len = r->pos = 0;
+    for (;;){
+        r->buff[r->len] = 0;
+        if ( (end = strstr(r->buff, "\r\n\r\n")) != NULL ){
+            r->pos = end + 4 - r->buff;
+            return r->pos;
+        }
+        if ( (end = strstr(r->buff, "\n\n")) != NULL ){
+            r->pos = end + 2 - r->buff;
+            return r->pos;
+        }
+        if (r->len >= FCGI_HEAD_MAX || (n = FcgiRead(fr, r->buff + r->len, FCGI_HEAD_MAX - r->len)) <= 0)
+            return -1;
+        r->len += n;
+    }
+}
+
+// script header value, NULL if it didn't give one
+char* FcgiHeader(const char* head, const char* name){
+    const char* line;
+    size_t len = strlen(name);
+
+    for (line = head; *line && *line != '\r' && *line != '\n'; line = strchr(line, '\n') + 1){
+        if (!strncasecmp(line, name, len) && line[len] == ':'){
+            line += len + 1;
+            line += strspn(line, " \t");
+            return strndup(line, strcspn(line, "\r\n"));
+        }
+        if (strchr(line, '\n') == NULL)
+            break;
+    }
+    return NULL;
+}
+
+// response to the client; 1 if the worker connection can take another
+// request, 0 if not, -1 if the client failed
+int FcgiRelay(client* c, fcgi_reader* fr, body_reader* r, const char* method){
+    char* head = r->buff;
+    char* status = FcgiHeader(head, "Status");
+    char* location = FcgiHeader(head, "Location");
+    char* length = FcgiHeader(head, "Content-Length");
+    char* type = FcgiHeader(head, "Content-Type");
+    int code = status != NULL ? atoi(status) : location != NULL ? 302 : 200;
+    long long size = length != NULL ? ContentLength(length) : -1;
+    int bodyless = !strcasecmp(method, "HEAD") || code == 204 || code == 304;
+    const char* line;
+    const char* next;
+    char* date;
+    char* out;
+    body_writer w;
+    int len, n, ret = 0;
+
+    if (code < 100 || code > 999)
+        code = 502;
+    if (length != NULL && size < 0){
+        // the body can't be framed, and the records are left unread
+        free(status);
+        free(location);
+        free(length);
+        free(type);
+        HttpError(c, 502);
+        return 0;
+    }
+    if (c->stream != NULL){
+        TraceFirstByte(&c->trace, c->socket, code);
+        H2WriteHeader(c->stream, code, size >= 0 && size <= INT_MAX ? size : -1, type, NULL, head);
+        Log("%s <- [%d] fastcgi h2\n", c->ip, code);
+    } else {
+        out = PoolGet(&buffer_pool);
+        if (status != NULL && strlen(status) > 4)
+            len = sprintf(out, "HTTP/1.1 %.64s\r\n", status);
+        else
+            len = sprintf(out, "HTTP/1.1 %d %s\r\n", code, Status(code));
+        if ( (date = FcgiHeader(head, "Date")) == NULL ){
+            HttpDate(out + len);
+            len += DATE_LEN;
+        }
+        free(date);
+        // CRLF or LF lines, all but Status
+        for (line = head; line < head + r->pos && *line != '\r' && *line != '\n'; line = next + 1){
+            next = strchr(line, '\n');
+            if (strncasecmp(line, "Status:", 7) && !ProxySkip(line)){
+                n = next - line - (next[-1] == '\r');
+                memcpy(out + len, line, n);
+                len += n;
+                len += sprintf(out + len, "\r\n");
+            }
+        }
+        if (size < 0 && !bodyless)
+            len += sprintf(out + len, "Transfer-Encoding: chunked\r\n");
+        if (draining)
+            len += sprintf(out + len, "Connection: close\r\n");
+        len += sprintf(out + len, "\r\n");
+        ret = ClientWrite(c, out, len);
+        PoolPut(&buffer_pool, out);
+        TraceFirstByte(&c->trace, c->socket, code);
+        Log("%s <- [%d] fastcgi\n", c->ip, code);
+    }
+
+    free(status);
+    free(location);
+    free(length);
+    free(type);
+    if (ret < 0)
+        return -1;
+
+    // the rest of the first read, then the records as they come
+    if (!bodyless && size >= 0){
+        n = MIN(size, r->len - r->pos);
+        for (;;){
+            if (n > 0 && ClientWrite(c, r->buff + r->pos, n) < 0)
+                return -1;
+            if ( (size -= n) == 0 )
+                break;
+            if ( (n = FcgiRead(fr, r->buff, MIN(size, BUFFER_LEN))) <= 0 )
+                return -1;  // cut short, the client can't be told otherwise
+            r->pos = 0;
+        }
+    } else if (!bodyless){
+        BodyInit(&w, c);
+        n = r->len - r->pos;
+        do
+            BodyWrite(&w, r->buff + r->pos, n);
+        while (!w.failed && (n = FcgiRead(fr, r->buff, BUFFER_LEN)) > 0 && (r->pos = 0) == 0);
+        if (BodyEnd(&w) || n < 0)
+            return -1;
+    }
+
+    // whatever the script wrote past what goes out, up to the end
+    while ( (n = FcgiRead(fr, r->buff, BUFFER_LEN)) > 0 );
+    return n == 0;
+}
+
+// request to the route's workers and the answer back; request is the head,
+// on HTTP/2 the one H2RequestHead() made. Returns 0 when the client connection can't carry on.
+int Fcgi(client* c, fcgi_route* route, const char* method, const char* request, int req_len, const char* path){
+    const char* end = request != NULL ? strstr(request, "\r\n\r\n") : NULL;
+    char* length = request != NULL ? HeaderValue(request, "Content-Length") : NULL;
+    char* encoding = request != NULL ? HeaderValue(request, "Transfer-Encoding") : NULL;
+    char* expect = request != NULL ? HeaderValue(request, "Expect") : NULL;
+    char* decoded = FcgiDecode(path);
+    const char* cont = "HTTP/1.1 100 Continue\r\n\r\n";
+    long long size = length != NULL ? ContentLength(length) : 0;
+    int has_body = encoding != NULL || size > 0;
+    int s = -1, reused = 0, tries, ret, code = 0;
+    fcgi_params p = { NULL, 0, 0 };
+    fcgi_reader fr;
+    body_reader q, r;
+
+    Log("%s -> %s %s fastcgi %s\n", c->ip, method, path, route->up->name);
+
+    if (!LimitRequest(c))
+        code = 429;
+    else if ((request != NULL && end == NULL) || decoded == NULL || size < 0)
+        code = 400;
+    else if (encoding != NULL)
+        code = 411;     // CGI scripts are given CONTENT_LENGTH
+    else
+        FcgiParams(&p, c, route, method, path, decoded, request, end, size);
+
+    q.c = r.c = c;
+    q.from = -1;
+    q.buff = r.buff = NULL;
+
+    // a reused connection may have been closed under us, one more try on a
+    // fresh one is safe as long as no body went out
+    for (tries = 0; code == 0 && tries < 2; tries++){
+        if ( (s = UpstreamGet(route->up, &reused)) == -1 ){
+            code = 502;
+            break;
+        }
+        TraceMark(&c->trace, TRACE_OPEN);
+        if (FcgiBegin(s, &p)){
+            close(s);
+            s = -1;
+            if (reused && !has_body)
+                continue;
+            code = 502;
+            break;
+        }
+
+        if (has_body){
+            if (expect != NULL && !strcasecmp(expect, "100-continue"))
+                ClientWrite(c, cont, strlen(cont));
+            q.buff = PoolGet(&buffer_pool);
+            q.len = request + req_len - (end + 4);
+            q.pos = 0;
+            memcpy(q.buff, end + 4, q.len);
+        }
+        if (FcgiStdin(&q, s, has_body ? size : 0)){
+            code = 502;
+            break;
+        }
+
+        fr.s = s;
+        fr.left = fr.pad = fr.ended = 0;
+        if (r.buff == NULL)
+            r.buff = PoolGet(&buffer_pool);
+        if ( (ret = FcgiReadHead(&fr, &r)) > 0 )
+            break;
+        code = errno == EAGAIN || errno == EWOULDBLOCK ? 504 : 502;
+        close(s);
+        s = -1;
+        if (r.len == 0 && !fr.ended && reused && !has_body){
+            code = 0;
+            continue;
+        }
+        break;
+    }
+
+    free(length);
+    free(encoding);
+    free(expect);
+    free(decoded);
+    free(p.data);
+    PoolPut(&buffer_pool, q.buff);
+
+    if (code != 0){
+        if (s != -1)
+            close(s);
+        PoolPut(&buffer_pool, r.buff);
+        // a request body may still be on the wire
+        HttpErrorConn(c, code, has_body);
+        return !has_body;
+    }
+
+    ret = FcgiRelay(c, &fr, &r, method);
+    PoolPut(&buffer_pool, r.buff);
+    if (ret == 1)
+        UpstreamPut(route->up, s);
+    else
+        close(s);
+    return ret >= 0 && !draining;
+}
+
+#endif // FCGI_FH
@@ -0,0 +1,1226 @@
+#ifndef HTTP2_FH
+#define HTTP2_FH
+
+#include <stdint.h>
+#include <time.h>
+
+// HTTP/2 (RFC 9113) on top of a connected client.
+//
+// The connection thread is the only one touching the socket (an SSL object
+// can't be read and written from two threads), it reads frames and flushes
+// the outgoing frame queue. Every request stream gets its own thread running
+// the same handler as HTTP/1.1, with a client whose writes become HEADERS and
+// DATA frames on the queue, blocking while the flow control window is closed.
+
+#define H2_PREFACE      "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN  24
+#define H2_FRAME_HDR    9
+#define H2_MAX_FRAME    16384      // biggest frame we take, protocol minimum
+#define H2_MAX_STREAMS  100        // concurrent streams (threads) per connection
+#define H2_WINDOW       65535      // initial flow control window
+#define H2_MAX_HEADERS  65536      // header block including CONTINUATION
+#define H2_TABLE_SIZE   4096       // HPACK dynamic table
+#define H2_MAX_AUTHORITY 255       // longer :authority makes the request malformed
+#define H2_MAX_FIELDS   (BUFFER_LEN - BUFFER_LEN_SMALL) // request fields kept for relaying
+#define H2_FLUSH_LEN    65536      // frames are coalesced up to this per write
+
+// frame types
+#define H2_DATA          0x0
+#define H2_HEADERS       0x1
+#define H2_PRIORITY      0x2
+#define H2_RST_STREAM    0x3
+#define H2_SETTINGS      0x4
+#define H2_PUSH_PROMISE  0x5
+#define H2_PING          0x6
+#define H2_GOAWAY        0x7
+#define H2_WINDOW_UPDATE 0x8
+#define H2_CONTINUATION  0x9
+
+// flags
+#define H2_END_STREAM    0x1
+#define H2_ACK           0x1
+#define H2_END_HEADERS   0x4
+#define H2_PADDED        0x8
+#define H2_PRIO          0x20
+
+// settings
+#define H2_SET_ENABLE_PUSH     0x2
+#define H2_SET_MAX_STREAMS     0x3
+#define H2_SET_INITIAL_WINDOW  0x4
+#define H2_SET_MAX_FRAME       0x5
+
+// error codes
+#define H2_NO_ERROR          0x0
+#define H2_PROTOCOL_ERROR    0x1
+#define H2_INTERNAL_ERROR    0x2
+#define H2_FLOW_CONTROL      0x3
+#define H2_STREAM_CLOSED     0x5
+#define H2_FRAME_SIZE        0x6
+#define H2_REFUSED_STREAM    0x7
+#define H2_COMPRESSION_ERROR 0x9
+
+#define BE16(p) ((uint32_t) (p)[0] << 8 | (p)[1])
+#define BE24(p) ((uint32_t) (p)[0] << 16 | (uint32_t) (p)[1] << 8 | (p)[2])
+#define BE32(p) ((uint32_t) (p)[0] << 24 | BE24((p)+1))
+
+typedef void RequestFunc(client*, const char*, char*);
+
+ssize_t ClientRead(client*, void*, size_t);
+ssize_t ClientWriteRaw(client*, const void*, size_t);
+int SetBusy(client*, int);
+
+typedef struct h2_frame {
+    struct h2_frame* next;
+    size_t len;
+    byte data[];
+} h2_frame;
+
+typedef struct {
+    char* name;
+    char* value;
+    size_t size;            // name + value + 32
+} hpack_entry;
+
+typedef struct {
+    hpack_entry entries[H2_TABLE_SIZE / 32];  // newest first
+    int count;
+    size_t size;
+    size_t max_size;
+} hpack_table;
+
+typedef struct h2_conn h2_conn;
+
+typedef struct h2_stream {
+    uint32_t id;
+    h2_conn* conn;
+    int64_t window;         // DATA we may still send
+    int reset;              // RST_STREAM either way
+    int ended;              // END_STREAM sent
+    int64_t remaining;      // body bytes announced by content-length, -1 unknown
+    char* method;
+    char* path;
+    char* authority;        // :authority, or host for the virtual host
+    char* fields;           // the other request fields as "name: value\r\n"
+    size_t fields_len;
+    int fields_over;        // more than H2_MAX_FIELDS, not all of them kept
+    int malformed;          // answered with RST_STREAM
+    struct h2_stream* next;
+} h2_stream;
+
+struct h2_conn {
+    client* c;
+    RequestFunc* handle;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;    // window opened, stream finished or connection lost
+    h2_frame* out_head;
+    h2_frame* out_tail;
+    int wake[2];            // queue went non empty
+
+    int64_t window;         // connection send window
+    int64_t initial_window; // peer SETTINGS_INITIAL_WINDOW_SIZE
+    uint32_t max_frame;     // peer SETTINGS_MAX_FRAME_SIZE
+    uint32_t last_stream;
+    int active;             // running stream threads
+    int goaway;             // no new streams
+    int dead;               // socket unusable
+    h2_stream* streams;
+
+    hpack_table table;
+    byte* block;            // header block being collected
+    size_t block_len;
+    uint32_t block_stream;  // waiting for CONTINUATION on this stream
+
+    const byte* pending;    // read before we knew it's HTTP/2
+    size_t pending_len;
+};
+
+/*****************************************************************************
+ *                                                                           *
+ *                                 HPACK                                     *
+ *                                                                           *
+ *****************************************************************************/
+
+const char* hpack_static[62][2] = {
+    { 0, 0 },
+    { ":authority", "" },
+    { ":method", "GET" },
+    { ":method", "POST" },
+    { ":path", "/" },
+    { ":path", "/index.html" },
+    { ":scheme", "http" },
+    { ":scheme", "https" },
+    { ":status", "200" },
+    { ":status", "204" },
+    { ":status", "206" },
+    { ":status", "304" },
+    { ":status", "400" },
+    { ":status", "404" },
+    { ":status", "500" },
+    { "accept-charset", "" },
+    { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" },
+    { "accept-ranges", "" },
+    { "accept", "" },
+    { "access-control-allow-origin", "" },
+    { "age", "" },
+    { "allow", "" },
+    { "authorization", "" },
+    { "cache-control", "" },
+    { "content-disposition", "" },
+    { "content-encoding", "" },
+    { "content-language", "" },
+    { "content-length", "" },
+    { "content-location", "" },
+    { "content-range", "" },
+    { "content-type", "" },
+    { "cookie", "" },
+    { "date", "" },
+    { "etag", "" },
+    { "expect", "" },
+    { "expires", "" },
+    { "from", "" },
+    { "host", "" },
+    { "if-match", "" },
+    { "if-modified-since", "" },
+    { "if-none-match", "" },
+    { "if-range", "" },
+    { "if-unmodified-since", "" },
+    { "last-modified", "" },
+    { "link", "" },
+    { "location", "" },
+    { "max-forwards", "" },
+    { "proxy-authenticate", "" },
+    { "proxy-authorization", "" },
+    { "range", "" },
+    { "referer", "" },
+    { "refresh", "" },
+    { "retry-after", "" },
+    { "server", "" },
+    { "set-cookie", "" },
+    { "strict-transport-security", "" },
+    { "transfer-encoding", "" },
+    { "user-agent", "" },
+    { "vary", "" },
+    { "via", "" },
+    { "www-authenticate", "" },
+};
+
+// RFC 7541 appendix B, index 256 is EOS
+const uint32_t hpack_huff_code[257] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+    0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+    0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+    0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+    0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+    0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+    0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+    0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+    0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+    0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+    0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+    0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+    0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+    0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+    0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+    0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+    0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+    0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+    0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+    0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+    0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+    0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+    0x3fffffff,
+};
+
+const byte hpack_huff_len[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+// decoding tree, leaves are -(symbol+1)
+short hpack_huff_tree[512][2];
+pthread_once_t hpack_huff_once = PTHREAD_ONCE_INIT;
+
+void HuffInit(){
+    int sym, bit, b, node, nodes = 1;
+
+    for ( sym = 0; sym < 257; sym++ ){
+        node = 0;
+        for ( bit = hpack_huff_len[sym] - 1; bit > 0; --bit ){
+            b = (hpack_huff_code[sym] >> bit) & 1;
+            if (!hpack_huff_tree[node][b])
+                hpack_huff_tree[node][b] = nodes++;
+            node = hpack_huff_tree[node][b];
+        }
+        hpack_huff_tree[node][hpack_huff_code[sym] & 1] = -(sym + 1);
+    }
+}
+
+int HuffDecode(const byte* in, size_t len, char* out){
+    int b, bit, next, node = 0, bits = 0, ones = 1, n = 0;
+    size_t i;
+
+    pthread_once(&hpack_huff_once, HuffInit);
+
+    FOR(i, len){
+        for ( b = 7; b >= 0; --b ){
+            bit = (in[i] >> b) & 1;
+            next = hpack_huff_tree[node][bit];
+            if (next == -257) return -1; // EOS inside a string
+            if (next < 0){
+                out[n++] = -next - 1;
+                node = bits = 0;
+                ones = 1;
+            } else {
+                node = next;
+                bits++;
+                ones &= bit;
+            }
+        }
+    }
+
+    return bits > 7 || !ones ? -1 : n; // only EOS prefix, all ones, may pad
+}
+
+int HpackInt(const byte** p, const byte* end, int prefix, uint32_t* value){
+    uint32_t max = (1 << prefix) - 1;
+    int m = 0;
+
+    if (*p >= end) return -1;
+    *value = *(*p)++ & max;
+    if (*value < max) return 0;
+
+    do {
+        if (*p >= end || m > 21) return -1;
+        *value += (uint32_t) (**p & 0x7f) << m;
+        m += 7;
+    } while (*(*p)++ & 0x80);
+
+    return 0;
+}
+
+char* HpackString(const byte** p, const byte* end){
+    int huff, n;
+    uint32_t len;
+    char* s;
+
+    if (*p >= end) return NULL;
+    huff = **p & 0x80;
+    if (HpackInt(p, end, 7, &len) || len > end - *p) return NULL;
+
+    if (huff){
+        s = MLC(char, len * 8 / 5 + 1); // 5 bits is the shortest code
+        if ( (n = HuffDecode(*p, len, s)) < 0 ){
+            free(s);
+            return NULL;
+        }
+    } else {
+        s = MLC(char, len + 1);
+        memcpy(s, *p, len);
+        n = len;
+    }
+
+    s[n] = 0;
+    *p += len;
+    return s;
+}
+
+void HpackEvict(hpack_table* t, size_t room){
+    hpack_entry* e;
+    while (t->count > 0 && t->size + room > t->max_size){
+        e = &t->entries[--t->count];
+        t->size -= e->size;
+        free(e->name);
+        free(e->value);
+    }
+}
+
+// takes over name and value
+void HpackAdd(hpack_table* t, char* name, char* value){
+    size_t size = strlen(name) + strlen(value) + 32;
+
+    HpackEvict(t, size);
+    if (size > t->max_size){ // too big, table just got emptied
+        free(name);
+        free(value);
+        return;
+    }
+
+    memmove(t->entries + 1, t->entries, t->count * sizeof(hpack_entry));
+    t->entries[0].name = name;
+    t->entries[0].value = value;
+    t->entries[0].size = size;
+    t->count++;
+    t->size += size;
+}
+
+int HpackGet(hpack_table* t, uint32_t index, const char** name, const char** value){
+    if (index == 0 || (index > 61 && index - 62 >= (uint32_t) t->count))
+        return -1;
+    if (index <= 61){
+        *name = hpack_static[index][0];
+        *value = hpack_static[index][1];
+    } else {
+        *name = t->entries[index - 62].name;
+        *value = t->entries[index - 62].value;
+    }
+    return 0;
+}
+
+// request fields we act on, st is NULL for refused streams. The ones that
+// aren't pseudo fields are kept in HTTP/1.1 form for proxy and FastCGI,
+// except those a body would need: request bodies aren't taken on HTTP/2.
+void H2Header(h2_stream* st, const char* name, const char* value){
+    size_t len;
+
+    if (st == NULL) return;
+    // they would end up in an HTTP/1.1 head
+    if (strpbrk(name, "\r\n") != NULL || strpbrk(value, "\r\n") != NULL){
+        st->malformed = 1;
+        return;
+    }
+    if (!strcmp(name, ":method") && st->method == NULL)
+        st->method = strdup(value);
+    else if (!strcmp(name, ":path") && st->path == NULL)
+        st->path = strdup(value);
+    else if (!strcmp(name, ":authority") || !strcmp(name, "host")){
+        if (strlen(value) > H2_MAX_AUTHORITY)
+            st->malformed = 1;
+        else if (st->authority == NULL)
+            st->authority = strdup(value);
+    }
+    else if (name[0] == ':')
+        return;     // :scheme
+    else if (strchr(name, ':') != NULL)
+        st->malformed = 1;
+    else if (strcmp(name, "content-length") && strcmp(name, "transfer-encoding")){
+        len = strlen(name) + strlen(value) + 4;
+        if (st->fields_len + len > H2_MAX_FIELDS){
+            st->fields_over = 1;
+            return;
+        }
+        st->fields = Realloc(st->fields, st->fields_len + len + 1);
+        st->fields_len += sprintf(st->fields + st->fields_len, "%s: %s\r\n", name, value);
+    }
+}
+
+// request line, Host and fields as an HTTP/1.1 head, NULL if fields were
+// left out
+char* H2RequestHead(h2_stream* st, const char* method, const char* path){
+    char* head;
+
+    if (st->fields_over)
+        return NULL;
+    head = MLC(char, strlen(method) + strlen(path) + H2_MAX_AUTHORITY + st->fields_len + 32);
+    sprintf(head, "%s %s HTTP/1.1\r\n%s%s%s%.*s\r\n", method, path,
+        st->authority != NULL ? "Host: " : "", st->authority != NULL ? st->authority : "",
+        st->authority != NULL ? "\r\n" : "", (int) st->fields_len, st->fields != NULL ? st->fields : "");
+    return head;
+}
+
+int HpackDecode(hpack_table* t, const byte* p, size_t len, h2_stream* st){
+    const byte* end = p + len;
+    const char *n, *v;
+    char *name, *value;
+    uint32_t index;
+    int indexing;
+
+    while (p < end){
+        if (*p & 0x80){
+            // indexed field
+            if (HpackInt(&p, end, 7, &index) || HpackGet(t, index, &n, &v))
+                return -1;
+            H2Header(st, n, v);
+        }
+        else if ((*p & 0xe0) == 0x20){
+            // dynamic table size update
+            if (HpackInt(&p, end, 5, &index) || index > H2_TABLE_SIZE)
+                return -1;
+            t->max_size = index;
+            HpackEvict(t, 0);
+        }
+        else {
+            // literal, with incremental indexing or without
+            indexing = (*p & 0xc0) == 0x40;
+            if (HpackInt(&p, end, indexing ? 6 : 4, &index))
+                return -1;
+            if (index == 0)
+                name = HpackString(&p, end);
+            else if (HpackGet(t, index, &n, &v))
+                return -1;
+            else
+                name = strdup(n);
+            if (name == NULL)
+                return -1;
+            if ( (value = HpackString(&p, end)) == NULL ){
+                free(name);
+                return -1;
+            }
+
+            H2Header(st, name, value);
+            if (indexing)
+                HpackAdd(t, name, value);
+            else {
+                free(name);
+                free(value);
+            }
+        }
+    }
+    return 0;
+}
+
+int HpackPutInt(byte* out, byte first, int prefix, uint32_t value){
+    uint32_t max = (1 << prefix) - 1;
+    int n = 0;
+
+    if (value < max){
+        out[0] = first | value;
+        return 1;
+    }
+
+    out[n++] = first | max;
+    for ( value -= max; value >= 128; value >>= 7 )
+        out[n++] = (value & 0x7f) | 0x80;
+    out[n++] = value;
+    return n;
+}
+
+// literal without indexing, name from the static table, no huffman
+int HpackPutField(byte* out, int name_index, const char* value){
+    int len = strlen(value);
+    int n = HpackPutInt(out, 0x00, 4, name_index);
+    n += HpackPutInt(out + n, 0x00, 7, len);
+    memcpy(out + n, value, len);
+    return n + len;
+}
+
+/*****************************************************************************
+ *                                                                           *
+ *                                 Frames                                    *
+ *                                                                           *
+ *****************************************************************************/
+
+void H2QueueLocked(h2_conn* h, byte type, byte flags, uint32_t id, const void* payload, size_t len){
+    h2_frame* f = Malloc(sizeof(h2_frame) + H2_FRAME_HDR + len);
+
+    f->next = NULL;
+    f->len = H2_FRAME_HDR + len;
+    f->data[0] = len >> 16;
+    f->data[1] = len >> 8;
+    f->data[2] = len;
+    f->data[3] = type;
+    f->data[4] = flags;
+    f->data[5] = (id >> 24) & 0x7f;
+    f->data[6] = id >> 16;
+    f->data[7] = id >> 8;
+    f->data[8] = id;
+    if (len) memcpy(f->data + H2_FRAME_HDR, payload, len);
+
+    if (h->out_tail != NULL)
+        h->out_tail->next = f;
+    else {
+        h->out_head = f;
+        if (write(h->wake[1], "F", 1) < 0) {} // already awake
+    }
+    h->out_tail = f;
+}
+
+void H2Queue(h2_conn* h, byte type, byte flags, uint32_t id, const void* payload, size_t len){
+    pthread_mutex_lock(&h->lock);
+    H2QueueLocked(h, type, flags, id, payload, len);
+    pthread_mutex_unlock(&h->lock);
+}
+
+void H2Reset(h2_conn* h, uint32_t id, uint32_t error){
+    byte p[4] = { error >> 24, error >> 16, error >> 8, error };
+    H2Queue(h, H2_RST_STREAM, 0, id, p, 4);
+}
+
+void H2GoAway(h2_conn* h, uint32_t error){
+    byte p[8];
+
+    pthread_mutex_lock(&h->lock);
+    if (!h->goaway){
+        p[0] = h->last_stream >> 24;
+        p[1] = h->last_stream >> 16;
+        p[2] = h->last_stream >> 8;
+        p[3] = h->last_stream;
+        p[4] = error >> 24;
+        p[5] = error >> 16;
+        p[6] = error >> 8;
+        p[7] = error;
+        H2QueueLocked(h, H2_GOAWAY, 0, 0, p, 8);
+        h->goaway = 1;
+    }
+    pthread_mutex_unlock(&h->lock);
+}
+
+void H2WindowUpdate(h2_conn* h, uint32_t id, uint32_t inc){
+    byte p[4] = { (inc >> 24) & 0x7f, inc >> 16, inc >> 8, inc };
+    H2Queue(h, H2_WINDOW_UPDATE, 0, id, p, 4);
+}
+
+// write out everything queued so far, -1 when the socket is gone; the
+// streams' ClientWrite() already took the bytes from the address limit
+int H2Flush(h2_conn* h){
+    h2_frame *f, *next;
+    byte* buff = MLC(byte, H2_FLUSH_LEN);
+    size_t len = 0;
+    int ret = 0;
+
+    pthread_mutex_lock(&h->lock);
+    f = h->out_head;
+    h->out_head = h->out_tail = NULL;
+    pthread_mutex_unlock(&h->lock);
+
+    for ( ; f != NULL; f = next ){
+        next = f->next;
+        if (len + f->len > H2_FLUSH_LEN){
+            if (ret == 0 && ClientWriteRaw(h->c, buff, len) < 0) ret = -1;
+            len = 0;
+        }
+        memcpy(buff + len, f->data, f->len); // frames never exceed H2_FLUSH_LEN
+        len += f->len;
+        free(f);
+    }
+    if (len && ret == 0 && ClientWriteRaw(h->c, buff, len) < 0)
+        ret = -1;
+
+    free(buff);
+    return ret;
+}
+
+int H2ReadFull(h2_conn* h, void* buff, size_t len){
+    byte* ptr = buff;
+    ssize_t n;
+
+    if (h->pending_len){
+        n = MIN(len, h->pending_len);
+        memcpy(ptr, h->pending, n);
+        h->pending += n;
+        h->pending_len -= n;
+        ptr += n;
+        len -= n;
+    }
+
+    while (len > 0){
+        if ( (n = ClientRead(h->c, ptr, len)) <= 0 )
+            return -1;
+        ptr += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// 1 if a frame can be read, 0 on timeout or wake up, -1 on error
+int H2Readable(h2_conn* h, int timeout_ms){
+    struct pollfd fds[2];
+    char buff[64];
+
+    if (h->pending_len > 0 || (h->c->ssl != NULL && SSL_pending(h->c->ssl) > 0))
+        return 1;
+
+    fds[0].fd = h->c->socket;
+    fds[0].events = POLLIN;
+    fds[1].fd = h->wake[0];
+    fds[1].events = POLLIN;
+
+    if (poll(fds, 2, timeout_ms) < 0)
+        return errno == EINTR ? 0 : -1;
+
+    if (fds[1].revents & POLLIN)
+        while (read(h->wake[0], buff, sizeof(buff)) == sizeof(buff));
+
+    return fds[0].revents ? 1 : 0;
+}
+
+/*****************************************************************************
+ *                                                                           *
+ *                                 Streams                                   *
+ *                                                                           *
+ *****************************************************************************/
+
+h2_stream* H2FindStream(h2_conn* h, uint32_t id){
+    h2_stream* st;
+    for ( st = h->streams; st != NULL && st->id != id; st = st->next );
+    return st;
+}
+
+// fields of a response that we set ourselves, or that HTTP/2 forbids
+const char* h2_skip[] = { "connection", "keep-alive", "proxy-connection", "transfer-encoding",
+    "upgrade", "te", "trailer", "status", "content-length", "content-type", "date", 0 };
+
+// "Name: value" lines, CRLF or LF, up to an empty one, as literals with
+// lower case names; the ones that don't fit in room are left out
+int H2PutFields(byte* out, int room, const char* fields){
+    const char* line;
+    const char* next;
+    const char* colon;
+    const char* value;
+    char name[BUFFER_LEN_SMALL];
+    int i, n = 0, name_len, value_len;
+
+    for (line = fields; *line && *line != '\r' && *line != '\n'; line = next){
+        next = line + strcspn(line, "\n");
+        if (*next)
+            next++;
+        value_len = strcspn(line, "\r\n");
+        if ( (colon = memchr(line, ':', value_len)) == NULL || (name_len = colon - line) >= sizeof(name) )
+            continue;
+        FOR(i, name_len)
+            name[i] = tolower((byte) line[i]);
+        name[name_len] = 0;
+        for (i = 0; h2_skip[i] && strcmp(name, h2_skip[i]); i++);
+        if (h2_skip[i])
+            continue;
+        for (value = colon + 1; *value == ' ' || *value == '\t'; value++);
+        value_len -= value - line;
+        // 0x00, name and value lengths take up to 5 bytes each
+        if (n + 11 + name_len + value_len > room)
+            continue;
+        n += HpackPutInt(out + n, 0x00, 4, 0);
+        n += HpackPutInt(out + n, 0x00, 7, name_len);
+        memcpy(out + n, name, name_len);
+        n += name_len;
+        n += HpackPutInt(out + n, 0x00, 7, value_len);
+        memcpy(out + n, value, value_len);
+        n += value_len;
+    }
+    return n;
+}
+
+// HEADERS frame for the response, content_length -1 and a NULL location
+// leave those out; fields are more of them, see H2PutFields()
+void H2WriteHeader(h2_stream* st, int code, int content_length, const char* type,
+    const char* location, const char* fields){
+
+    h2_conn* h = st->conn;
+    byte block[BUFFER_LEN];
+    char num[DATE_LEN];
+    int n = 0;
+
+    switch (code) {
+        case 200: n = HpackPutInt(block, 0x80, 7, 8);  break;
+        case 204: n = HpackPutInt(block, 0x80, 7, 9);  break;
+        case 206: n = HpackPutInt(block, 0x80, 7, 10); break;
+        case 304: n = HpackPutInt(block, 0x80, 7, 11); break;
+        case 400: n = HpackPutInt(block, 0x80, 7, 12); break;
+        case 404: n = HpackPutInt(block, 0x80, 7, 13); break;
+        case 500: n = HpackPutInt(block, 0x80, 7, 14); break;
+        default:
+            sprintf(num, "%d", code);
+            n = HpackPutField(block, 8, num);
+    }
+
+    if (content_length >= 0){
+        sprintf(num, "%d", content_length);
+        n += HpackPutField(block + n, 28, num);
+    }
+    if (type != NULL && strlen(type) < BUFFER_LEN_SMALL / 4)
+        n += HpackPutField(block + n, 31, type);
+    if (location != NULL && strlen(location) < BUFFER_LEN_SMALL / 2)
+        n += HpackPutField(block + n, 46, location);
+
+    HttpDate(num);
+    num[DATE_LEN - 2] = 0;  // value without the name and CRLF
+    n += HpackPutField(block + n, 33, num + 6);
+    if (fields != NULL)
+        n += H2PutFields(block + n, sizeof(block) - n, fields);
+
+    pthread_mutex_lock(&h->lock);
+    st->remaining = content_length >= 0 ? content_length : -1;
+    if (!st->reset && !h->dead)
+        H2QueueLocked(h, H2_HEADERS, H2_END_HEADERS, st->id, block, n);
+    pthread_mutex_unlock(&h->lock);
+}
+
+// DATA frames, waits for the peer to open the window. The frame that
+// completes a known content-length carries END_STREAM, clients consider
+// the response done at that point.
+ssize_t H2Write(h2_stream* st, const void* buff, size_t len){
+    h2_conn* h = st->conn;
+    const byte* ptr = buff;
+    size_t left = len, n;
+    byte flags;
+
+    pthread_mutex_lock(&h->lock);
+    while (left > 0){
+        while (!st->reset && !h->dead && (st->window <= 0 || h->window <= 0))
+            pthread_cond_wait(&h->cond, &h->lock);
+        if (st->reset || h->dead || st->ended){
+            pthread_mutex_unlock(&h->lock);
+            errno = EPIPE;
+            return -1;
+        }
+
+        n = MIN(left, h->max_frame);
+        n = MIN(n, st->window);
+        n = MIN(n, h->window);
+        flags = 0;
+        if (st->remaining > 0 && (st->remaining -= n) <= 0){
+            flags = H2_END_STREAM;
+            st->ended = 1;
+        }
+        H2QueueLocked(h, H2_DATA, flags, st->id, ptr, n);
+        st->window -= n;
+        h->window -= n;
+        ptr += n;
+        left -= n;
+    }
+    pthread_mutex_unlock(&h->lock);
+    return len;
+}
+
+void H2EndStream(h2_stream* st){
+    h2_conn* h = st->conn;
+    h2_stream** ptr;
+
+    pthread_mutex_lock(&h->lock);
+    if (!st->reset && !h->dead && !st->ended)
+        H2QueueLocked(h, H2_DATA, H2_END_STREAM, st->id, NULL, 0);
+    for ( ptr = &h->streams; *ptr != st; ptr = &(*ptr)->next );
+    *ptr = st->next;
+    h->active--;
+    pthread_cond_broadcast(&h->cond);
+    pthread_mutex_unlock(&h->lock);
+
+    free(st->method);
+    free(st->path);
+    free(st->authority);
+    free(st->fields);
+    free(st);
+}
+
+void* H2StreamThread(void* args){
+    h2_stream* st = (h2_stream*) args;
+    client sc = *st->conn->c;
+
+    sc.stream = st;
+    sc.host = st->authority;
+    TraceStart(&sc.trace);
+    TraceMark(&sc.trace, TRACE_PARSED);
+    PROBE3(parsed, sc.socket, st->method, st->path);
+    st->conn->handle(&sc, st->method, st->path);
+    TraceEnd(&sc.trace, sc.socket, sc.ip, st->method, st->path);
+    H2EndStream(st);
+    pthread_exit(0);
+}
+
+void H2StartStream(h2_conn* h, h2_stream* st){
+    pthread_attr_t attr;
+    pthread_t tid;
+
+    pthread_mutex_lock(&h->lock);
+    st->next = h->streams;
+    h->streams = st;
+    h->active++;
+    pthread_mutex_unlock(&h->lock);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&tid, &attr, H2StreamThread, (void*) st)){
+        Warnx("pthread_create: %s", strerror(errno));
+        pthread_mutex_lock(&h->lock);
+        st->reset = 1;
+        pthread_mutex_unlock(&h->lock);
+        H2Reset(h, st->id, H2_REFUSED_STREAM);
+        H2EndStream(st);
+    }
+    pthread_attr_destroy(&attr);
+}
+
+h2_stream* H2NewStream(h2_conn* h, uint32_t id){
+    h2_stream* st = Calloc(sizeof(h2_stream));
+    st->id = id;
+    st->conn = h;
+    st->window = h->initial_window;
+    st->remaining = -1;
+    return st;
+}
+
+/*****************************************************************************
+ *                                                                           *
+ *                                 Connection                                *
+ *                                                                           *
+ *****************************************************************************/
+
+// returns an error code for GOAWAY
+uint32_t H2Settings(h2_conn* h, const byte* p, size_t len){
+    uint32_t id, value, error = H2_NO_ERROR;
+    h2_stream* st;
+
+    pthread_mutex_lock(&h->lock);
+    for ( ; len >= 6 && error == H2_NO_ERROR; p += 6, len -= 6 ){
+        id = BE16(p);
+        value = BE32(p + 2);
+        switch (id) {
+            case H2_SET_ENABLE_PUSH:
+                if (value > 1) error = H2_PROTOCOL_ERROR;
+                break;
+            case H2_SET_INITIAL_WINDOW:
+                if (value > 0x7fffffff){
+                    error = H2_FLOW_CONTROL;
+                    break;
+                }
+                for ( st = h->streams; st != NULL; st = st->next )
+                    st->window += (int64_t) value - h->initial_window;
+                h->initial_window = value;
+                break;
+            case H2_SET_MAX_FRAME:
+                if (value < 16384 || value > 16777215)
+                    error = H2_PROTOCOL_ERROR;
+                else
+                    h->max_frame = MIN(value, H2_FLUSH_LEN - H2_FRAME_HDR);
+                break;
+        }
+    }
+    pthread_cond_broadcast(&h->cond);
+    pthread_mutex_unlock(&h->lock);
+    return error;
+}
+
+uint32_t H2Headers(h2_conn* h, uint32_t id){
+    h2_stream* st = NULL;
+    uint32_t error;
+    int refuse;
+
+    pthread_mutex_lock(&h->lock);
+    if (id <= h->last_stream){
+        // trailers of a stream we already serve, or a closed one
+        pthread_mutex_unlock(&h->lock);
+        if (HpackDecode(&h->table, h->block, h->block_len, NULL))
+            return H2_COMPRESSION_ERROR;
+        return H2FindStream(h, id) != NULL ? H2_NO_ERROR : H2_STREAM_CLOSED;
+    }
+    refuse = h->goaway || h->active >= H2_MAX_STREAMS;
+    if (!h->goaway)
+        h->last_stream = id;
+    pthread_mutex_unlock(&h->lock);
+
+    // the table has to be kept in sync even for streams we refuse
+    if (!refuse)
+        st = H2NewStream(h, id);
+    error = HpackDecode(&h->table, h->block, h->block_len, st) ?
+        H2_COMPRESSION_ERROR : H2_NO_ERROR;
+
+    if (refuse)
+        H2Reset(h, id, H2_REFUSED_STREAM);
+    else if (error == H2_NO_ERROR && st->method != NULL && st->path != NULL && !st->malformed){
+        H2StartStream(h, st);
+        return error;
+    } else {
+        if (error == H2_NO_ERROR)
+            H2Reset(h, id, H2_PROTOCOL_ERROR);
+        free(st->method);
+        free(st->path);
+        free(st->authority);
+    free(st->fields);
+        free(st);
+    }
+
+    return error;
+}
+
+// returns an error code for GOAWAY
+uint32_t H2Frame(h2_conn* h, byte type, byte flags, uint32_t id, byte* p, uint32_t len){
+    h2_stream* st;
+    uint32_t inc, pad = 0;
+
+    if (h->block_stream && (type != H2_CONTINUATION || id != h->block_stream))
+        return H2_PROTOCOL_ERROR;
+
+    switch (type) {
+        case H2_DATA:
+            if (id == 0) return H2_PROTOCOL_ERROR;
+            // request bodies are not used, give the window straight back
+            if (len){
+                H2WindowUpdate(h, 0, len);
+                pthread_mutex_lock(&h->lock);
+                st = H2FindStream(h, id);
+                pthread_mutex_unlock(&h->lock);
+                if (st != NULL && !(flags & H2_END_STREAM))
+                    H2WindowUpdate(h, id, len);
+            }
+            break;
+
+        case H2_HEADERS:
+            if (id == 0 || id % 2 == 0) return H2_PROTOCOL_ERROR;
+            if (flags & H2_PADDED){
+                if (len < 1) return H2_PROTOCOL_ERROR;
+                pad = p[0];
+                p++, len--;
+            }
+            if (flags & H2_PRIO){
+                if (len < 5) return H2_PROTOCOL_ERROR;
+                p += 5, len -= 5;
+            }
+            if (pad > len) return H2_PROTOCOL_ERROR;
+            len -= pad;
+            h->block_len = 0;
+            // fall through
+        case H2_CONTINUATION:
+            if (type == H2_CONTINUATION && h->block_stream != id)
+                return H2_PROTOCOL_ERROR;
+            if (h->block_len + len > H2_MAX_HEADERS)
+                return H2_PROTOCOL_ERROR;
+            memcpy(h->block + h->block_len, p, len);
+            h->block_len += len;
+            if (!(flags & H2_END_HEADERS)){
+                h->block_stream = id;
+                break;
+            }
+            h->block_stream = 0;
+            return H2Headers(h, id);
+
+        case H2_PRIORITY:
+            if (id == 0 || len != 5) return H2_PROTOCOL_ERROR;
+            break;
+
+        case H2_RST_STREAM:
+            if (id == 0 || len != 4) return H2_PROTOCOL_ERROR;
+            pthread_mutex_lock(&h->lock);
+            if ( (st = H2FindStream(h, id)) != NULL )
+                st->reset = 1;
+            pthread_cond_broadcast(&h->cond);
+            pthread_mutex_unlock(&h->lock);
+            break;
+
+        case H2_SETTINGS:
+            if (id != 0 || len % 6) return H2_PROTOCOL_ERROR;
+            if (flags & H2_ACK) break;
+            if ( (inc = H2Settings(h, p, len)) != H2_NO_ERROR )
+                return inc;
+            H2Queue(h, H2_SETTINGS, H2_ACK, 0, NULL, 0);
+            break;
+
+        case H2_PUSH_PROMISE:
+            return H2_PROTOCOL_ERROR;
+
+        case H2_PING:
+            if (id != 0 || len != 8) return H2_PROTOCOL_ERROR;
+            if (!(flags & H2_ACK))
+                H2Queue(h, H2_PING, H2_ACK, 0, p, 8);
+            break;
+
+        case H2_GOAWAY:
+            // finish what we have, nothing new will come
+            pthread_mutex_lock(&h->lock);
+            h->goaway = 1;
+            pthread_mutex_unlock(&h->lock);
+            break;
+
+        case H2_WINDOW_UPDATE:
+            if (len != 4) return H2_PROTOCOL_ERROR;
+            inc = BE32(p) & 0x7fffffff;
+            pthread_mutex_lock(&h->lock);
+            st = NULL;
+            if (id == 0){
+                h->window += inc;
+                if (inc == 0 || h->window > 0x7fffffff){
+                    pthread_mutex_unlock(&h->lock);
+                    return inc ? H2_FLOW_CONTROL : H2_PROTOCOL_ERROR;
+                }
+            } else if ( (st = H2FindStream(h, id)) != NULL ){
+                st->window += inc;
+                st->reset = inc == 0 || st->window > 0x7fffffff;
+            }
+            pthread_cond_broadcast(&h->cond);
+            pthread_mutex_unlock(&h->lock);
+            if (st != NULL && st->reset)
+                H2Reset(h, id, inc ? H2_FLOW_CONTROL : H2_PROTOCOL_ERROR);
+            break;
+
+        default:
+            break; // unknown frames are ignored
+    }
+
+    return H2_NO_ERROR;
+}
+
+// 0 ok, -1 connection gone or broken
+int H2ReadFrame(h2_conn* h){
+    byte hdr[H2_FRAME_HDR];
+    byte* payload;
+    uint32_t len, error;
+
+    if (H2ReadFull(h, hdr, H2_FRAME_HDR))
+        return -1;
+
+    len = BE24(hdr);
+    if (len > H2_MAX_FRAME){
+        H2GoAway(h, H2_FRAME_SIZE);
+        return -1;
+    }
+
+    payload = MLC(byte, len + 1);
+    if (H2ReadFull(h, payload, len)){
+        free(payload);
+        return -1;
+    }
+
+    error = H2Frame(h, hdr[3], hdr[4], BE32(hdr + 5) & 0x7fffffff, payload, len);
+    free(payload);
+
+    if (error != H2_NO_ERROR){
+        Warnx("http2: connection error %u", error);
+        H2GoAway(h, error);
+        return -1;
+    }
+    return 0;
+}
+
+int Base64UrlDecode(const char* in, byte* out){
+    uint32_t acc = 0;
+    int bits = 0, n = 0, v;
+
+    for ( ; *in && *in != '='; in++ ){
+        if      (*in >= 'A' && *in <= 'Z') v = *in - 'A';
+        else if (*in >= 'a' && *in <= 'z') v = *in - 'a' + 26;
+        else if (*in >= '0' && *in <= '9') v = *in - '0' + 52;
+        else if (*in == '-' || *in == '+') v = 62;
+        else if (*in == '_' || *in == '/') v = 63;
+        else return -1;
+
+        acc = acc << 6 | v;
+        if ( (bits += 6) >= 8 ){
+            bits -= 8;
+            out[n++] = acc >> bits;
+        }
+    }
+    return n;
+}
+
+// Serve an HTTP/2 connection until it closes. pending holds bytes already
+// read from the socket. upgrade_path and upgrade_settings come from an
+// HTTP/1.1 Upgrade: h2c request that becomes stream 1.
+void H2Serve(client* c, RequestFunc* handle, const byte* pending, size_t pending_len,
+             const char* upgrade_path, const char* upgrade_settings){
+
+    h2_conn* h = Calloc(sizeof(h2_conn));
+    h2_stream* st;
+    byte preface[H2_PREFACE_LEN];
+    byte* settings;
+    time_t idle = time(NULL);
+    int n, r, keepalive;
+
+    h->c = c;
+    h->handle = handle;
+    h->window = H2_WINDOW;
+    h->initial_window = H2_WINDOW;
+    h->max_frame = H2_MAX_FRAME;
+    h->table.max_size = H2_TABLE_SIZE;
+    h->block = MLC(byte, H2_MAX_HEADERS);
+    h->pending = pending;
+    h->pending_len = pending_len;
+    pthread_mutex_init(&h->lock, NULL);
+    pthread_cond_init(&h->cond, NULL);
+    if (pipe(h->wake)) Error("pipe");
+    fcntl(h->wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(h->wake[1], F_SETFL, O_NONBLOCK);
+
+    // our SETTINGS is the server preface
+    byte ours[6] = { 0, H2_SET_MAX_STREAMS, 0, 0, 0, H2_MAX_STREAMS };
+    H2Queue(h, H2_SETTINGS, 0, 0, ours, 6);
+
+    if (upgrade_path != NULL){
+        settings = MLC(byte, strlen(upgrade_settings) + 1);
+        if ( (n = Base64UrlDecode(upgrade_settings, settings)) >= 0 )
+            H2Settings(h, settings, n - n % 6);
+        free(settings);
+
+        h->last_stream = 1;
+        st = H2NewStream(h, 1);
+        st->method = strdup("GET");
+        st->path = strdup(upgrade_path);
+        if (c->host != NULL)
+            st->authority = strdup(c->host);
+        H2StartStream(h, st);
+    }
+
+    if (H2ReadFull(h, preface, H2_PREFACE_LEN) ||
+        memcmp(preface, H2_PREFACE, H2_PREFACE_LEN)){
+        H2GoAway(h, H2_PROTOCOL_ERROR);
+        h->dead = 1;
+    }
+
+    while (!h->dead){
+        if (H2Flush(h) < 0)
+            break;
+
+        pthread_mutex_lock(&h->lock);
+        n = h->active;
+        r = h->goaway && n == 0 && h->out_head == NULL;
+        pthread_mutex_unlock(&h->lock);
+        if (r) break;
+
+        // busy while streams run, a drain then ends with GOAWAY
+        if (!SetBusy(c, n > 0))
+            H2GoAway(h, H2_NO_ERROR);
+
+        if ( (r = H2Readable(h, 1000)) < 0 )
+            break;
+        if (r == 0){
+            // nothing stays pinned while the connection idles
+            keepalive = Conf()->keepalive;
+            ConfPut();
+            if (n == 0 && time(NULL) - idle >= keepalive)
+                H2GoAway(h, H2_NO_ERROR);
+            continue;
+        }
+
+        idle = time(NULL);
+        if (H2ReadFrame(h) < 0){
+            H2Flush(h); // GOAWAY, if there is one
+            break;
+        }
+    }
+
+    // release stream threads stuck on the window and wait for them
+    pthread_mutex_lock(&h->lock);
+    h->dead = 1;
+    pthread_cond_broadcast(&h->cond);
+    while (h->active > 0)
+        pthread_cond_wait(&h->cond, &h->lock);
+    pthread_mutex_unlock(&h->lock);
+
+    while (h->out_head != NULL){
+        h->out_tail = h->out_head->next;
+        free(h->out_head);
+        h->out_head = h->out_tail;
+    }
+    HpackEvict(&h->table, H2_TABLE_SIZE + 1);
+    close(h->wake[0]);
+    close(h->wake[1]);
+    pthread_mutex_destroy(&h->lock);
+    pthread_cond_destroy(&h->cond);
+    free(h->block);
+    free(h);
+}
+
+#endif // HTTP2_FH
@@ -0,0 +1,275 @@
+#ifndef LIMIT_FH
+#define LIMIT_FH
+
+#include <time.h>
+
+// Per client address limits, and pacing of bulk transfers.
+//
+// Every peer address has an entry with its open connections and two token
+// buckets, one for requests and one for response bytes. Entries live in a
+// hash table split into shards with a lock each, so clients from different
+// addresses rarely touch the same lock. An entry without connections that
+// has not been used for LIMIT_IDLE seconds is unlinked by whoever walks its
+// chain next, there is no sweeper thread.
+
+#define LIMIT_SHARDS  16
+#define LIMIT_BUCKETS 256   // per shard
+#define LIMIT_IDLE    60    // seconds
+#define LIMIT_CHUNK   65536 // largest write between bandwidth checks
+#define EGRESS_BURST  MAX(LIMIT_CHUNK, limits.total_bps / 10) // 100ms worth
+
+typedef struct limit_entry {
+    char* ip;
+    int conns;
+    double req_tokens;
+    double byte_tokens;
+    int64_t refilled;       // ns, monotonic
+    int64_t seen;           // last connect or disconnect
+    struct limit_shard* shard;
+    struct limit_entry* next;
+} limit_entry;
+
+typedef struct limit_shard {
+    pthread_mutex_t lock;
+    limit_entry* buckets[LIMIT_BUCKETS];
+} limit_shard;
+
+// -R name=value, 0 is no limit
+typedef struct {
+    int conns;          // open connections per address
+    int rps;            // requests per second
+    int burst;          // request bucket size, defaults to rps
+    int bps;            // response bytes per second per address
+    int conn_bps;       // paced rate of every connection
+    int total_bps;      // egress of all bulk transfers together
+} limit_opts;
+
+limit_opts limits = { 0, 0, 0, 0, 0, 0 };
+limit_shard limit_shards[LIMIT_SHARDS];
+
+// all bulk transfers share it
+double egress_tokens = 0;
+int64_t egress_refilled = 0;
+pthread_mutex_t egress_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct {
+    char* name;
+    int* value;
+} limit_names [] = {
+    { "conns",  &limits.conns   },
+    { "rps",    &limits.rps     },
+    { "burst",  &limits.burst   },
+    { "bps",    &limits.bps     },
+    { "conn_bps",   &limits.conn_bps    },
+    { "total_bps",  &limits.total_bps   },
+    { 0,        0               }
+};
+
+void ParseLimit(const char* opt){
+    const char* eq = strchr(opt, '=');
+    long long n;
+    int i;
+
+    if (eq == NULL)
+        Errx(MP_PARAM_ERR, "limit %s needs a value", opt);
+
+    for ( i = 0; limit_names[i].name; i++ ){
+        if ( strlen(limit_names[i].name) == eq - opt &&
+             !strncmp(opt, limit_names[i].name, eq - opt) ){
+            if (!ParseNumber(eq + 1, INT_MAX, &n))
+                Errx(MP_PARAM_ERR, "limit %s is not a number from 0 to %d", opt, INT_MAX);
+            *limit_names[i].value = n;
+            return;
+        }
+    }
+
+    Errx(MP_PARAM_ERR, "unknown limit %s", opt);
+}
+
+void LimitInit(){
+    int i;
+    if (limits.burst < limits.rps)
+        limits.burst = limits.rps;
+    egress_tokens = EGRESS_BURST;
+    FOR(i, LIMIT_SHARDS){
+        pthread_mutex_init(&limit_shards[i].lock, NULL);
+        memset(limit_shards[i].buckets, 0, sizeof(limit_shards[i].buckets));
+    }
+}
+
+int LimitsOn(){
+    return limits.conns || limits.rps || limits.bps;
+}
+
+int64_t LimitNow(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+unsigned int LimitHash(const char* ip){
+    unsigned int h = 2166136261u; // FNV-1a
+    while (*ip){
+        h ^= (byte) *ip++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// shard lock held
+void LimitRefillLocked(limit_entry* e, int64_t now){
+    double secs = (now - e->refilled) / 1e9;
+
+    e->req_tokens = MIN(limits.burst, e->req_tokens + secs * limits.rps);
+    e->byte_tokens = MIN(limits.bps, e->byte_tokens + secs * limits.bps);
+    e->refilled = now;
+}
+
+// takes a connection slot for c's address, 0 if it has too many already
+int LimitConnect(client* c){
+    unsigned int h = LimitHash(c->ip);
+    limit_shard* shard = limit_shards + h % LIMIT_SHARDS;
+    limit_entry** pe;
+    limit_entry* e;
+    int64_t now = LimitNow();
+    int ok;
+
+    c->limit = NULL;
+    if (!LimitsOn() || !strcmp(c->ip, "unix"))
+        return 1;
+
+    pthread_mutex_lock(&shard->lock);
+    pe = shard->buckets + h / LIMIT_SHARDS % LIMIT_BUCKETS;
+    while ( (e = *pe) != NULL ){
+        if (!strcmp(e->ip, c->ip))
+            break;
+        // expire idle neighbours on the way
+        if (e->conns == 0 && now - e->seen > LIMIT_IDLE * 1000000000LL){
+            *pe = e->next;
+            free(e->ip);
+            free(e);
+            continue;
+        }
+        pe = &e->next;
+    }
+
+    if (e == NULL){
+        e = Calloc(sizeof(limit_entry));
+        e->ip = strdup(c->ip);
+        e->req_tokens = limits.burst;
+        e->byte_tokens = limits.bps;
+        e->refilled = now;
+        e->shard = shard;
+        e->next = *pe;
+        *pe = e;
+    }
+
+    e->seen = now;
+    if ( (ok = !limits.conns || e->conns < limits.conns) ){
+        e->conns++;
+        c->limit = e;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return ok;
+}
+
+void LimitDisconnect(client* c){
+    limit_entry* e = c->limit;
+
+    if (e == NULL)
+        return;
+    pthread_mutex_lock(&e->shard->lock);
+    e->conns--;
+    e->seen = LimitNow();
+    pthread_mutex_unlock(&e->shard->lock);
+    c->limit = NULL;
+}
+
+// one request token, 0 if the address is over its rate
+int LimitRequest(client* c){
+    limit_entry* e = c->limit;
+    int ok;
+
+    if (e == NULL || !limits.rps)
+        return 1;
+    pthread_mutex_lock(&e->shard->lock);
+    LimitRefillLocked(e, LimitNow());
+    if ( (ok = e->req_tokens >= 1) )
+        e->req_tokens--;
+    pthread_mutex_unlock(&e->shard->lock);
+    return ok;
+}
+
+// sleep for debt bytes at rate, before going on
+void PaceSleep(double debt, int rate){
+    if (debt > 0)
+        usleep(debt * 1000000 / rate);
+}
+
+// takes len byte tokens, sleeps off any debt so the address stays at bps
+void LimitBytes(client* c, size_t len){
+    limit_entry* e = c->limit;
+    double debt;
+
+    if (e == NULL || !limits.bps)
+        return;
+    pthread_mutex_lock(&e->shard->lock);
+    LimitRefillLocked(e, LimitNow());
+    e->byte_tokens -= len;
+    debt = -e->byte_tokens;
+    pthread_mutex_unlock(&e->shard->lock);
+
+    PaceSleep(debt, limits.bps);
+}
+
+// PACING
+//
+// Bulk transfers (ClientSendFile() past LIMIT_CHUNK) are paced so a few
+// big downloads don't fill the uplink ahead of small responses. A
+// connection is paced by the kernel through SO_MAX_PACING_RATE when it
+// can be, otherwise here, between chunks. The total_bps budget is shared
+// by every bulk transfer and only exists in userspace.
+
+// connection setup; kernel pacing for TCP sockets that take it
+void PaceStart(client* c, int tcp){
+    c->pace_kernel = limits.conn_bps && tcp && SetPacingRate(c->socket, limits.conn_bps);
+    c->pace_tokens = LIMIT_CHUNK;
+    c->pace_refilled = LimitNow();
+}
+
+int Paced(client* c, size_t count){
+    return (c->limit != NULL && limits.bps) || (count > LIMIT_CHUNK &&
+        (limits.total_bps || (limits.conn_bps && !c->pace_kernel)));
+}
+
+// before n more bytes of a count byte bulk send
+void PaceSend(client* c, size_t n, size_t count){
+    int64_t now;
+    double debt;
+
+    if (count <= LIMIT_CHUNK)
+        return;
+
+    if (limits.conn_bps && !c->pace_kernel){
+        now = LimitNow();
+        c->pace_tokens = MIN(LIMIT_CHUNK, c->pace_tokens +
+            (now - c->pace_refilled) / 1e9 * limits.conn_bps);
+        c->pace_refilled = now;
+        c->pace_tokens -= n;
+        PaceSleep(-c->pace_tokens, limits.conn_bps);
+    }
+
+    if (limits.total_bps){
+        pthread_mutex_lock(&egress_lock);
+        now = LimitNow();
+        egress_tokens = MIN(EGRESS_BURST, egress_tokens +
+            (now - egress_refilled) / 1e9 * limits.total_bps);
+        egress_refilled = now;
+        egress_tokens -= n;
+        debt = -egress_tokens;
+        pthread_mutex_unlock(&egress_lock);
+        PaceSleep(debt, limits.total_bps);
+    }
+}
+
+#endif // LIMIT_FH
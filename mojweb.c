@@ -28,26 +28,278 @@ int TurnOn(const char* udp_port){
 	return socket;
 }
 
+// control datagrams on the udp port
+#define CTL_NONE    0
+#define CTL_OFF     1
+#define CTL_RESTART 2
+
 int TurnOff(int socket){
 	char* buff = MLC(char, 10);
 	ssize_t len;
-	int ret = 0;
+	int ret = CTL_NONE;
 
 	len = Recvfrom(socket, buff, 10, 0, NULL, NULL);
 	if (len < 0) Error("udp recvfrom");
 	if (len >= 3 && !strncmp("OFF", buff, 3)){
 		Log("Recieved OFF\n");
-		ret = 1;
+		ret = CTL_OFF;
+	}
+	else if (len >= 7 && !strncmp("RESTART", buff, 7)){
+		Log("Recieved RESTART\n");
+		ret = CTL_RESTART;
 	}
 
 	free(buff);
 	return ret;
 }
 
+// CLIENTS
+
+client* clients[MAX_THREAD];
+int num_clients = 0;
+pthread_mutex_t clients_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t  clients_cond = PTHREAD_COND_INITIALIZER;
+
+volatile sig_atomic_t draining = 0;
+int wake_pipe[2] = { -1, -1 }; // signals and exiting clients wake up main
+
+void Wake(char why){
+	int saved = errno;
+	if (write(wake_pipe[1], &why, 1) < 0) {} // pipe full, main is awake anyway
+	errno = saved;
+}
+
+void OnSignal(int signo){
+	Wake(signo == SIGUSR2 ? 'R' : signo == SIGUSR1 ? 'T' : signo == SIGHUP ? 'H' : 'D');
+}
+
+client* AddClient(int socket, int tls){
+	client* c = NULL;
+	int i;
+
+	pthread_mutex_lock(&clients_lock);
+	if (num_clients < conf->max_clients && !draining){
+		for (i = 0; clients[i] != NULL; i++);
+		c = PoolGet(&client_pool);
+		c->socket = socket;
+		c->slot = i;
+		c->busy = 0;
+		c->ip = GetClientInfo(socket, NULL);
+		c->tls = tls;
+		c->ssl = NULL;
+		c->ktls = 0;
+		c->stream = NULL;
+		c->host = NULL;
+		c->head = 0;
+		c->limit = NULL;
+		c->trace.on = 0;
+		c->trace.status = 0;
+		clients[i] = c;
+		num_clients++;
+	}
+	pthread_mutex_unlock(&clients_lock);
+	return c;
+}
+
+void RemoveClient(client* c){
+	pthread_mutex_lock(&clients_lock);
+	clients[c->slot] = NULL;
+	num_clients--;
+	pthread_cond_signal(&clients_cond);
+	pthread_mutex_unlock(&clients_lock);
+
+	Wake('C');
+	LimitDisconnect(c);
+	free(c->ip);
+	PoolPut(&client_pool, c);
+}
+
+// returns 0 if the client should stop reading requests
+int SetBusy(client* c, int busy){
+	int ret;
+	pthread_mutex_lock(&clients_lock);
+	c->busy = busy;
+	ret = !draining;
+	pthread_mutex_unlock(&clients_lock);
+	return ret;
+}
+
+// stop taking new requests, idle keep-alive clients are woken up right away
+void Drain(){
+	int i;
+	pthread_mutex_lock(&clients_lock);
+	if (!draining)
+		Log("Draining %d clients\n", num_clients);
+	draining = 1;
+	FOR(i, MAX_THREAD){
+		if (clients[i] != NULL && !clients[i]->busy)
+			shutdown(clients[i]->socket, SHUT_RD);
+	}
+	pthread_mutex_unlock(&clients_lock);
+}
+
+void WaitClients(){
+	pthread_mutex_lock(&clients_lock);
+	while (num_clients > 0)
+		pthread_cond_wait(&clients_cond, &clients_lock);
+	pthread_mutex_unlock(&clients_lock);
+}
+
+// HOT RESTART
+//
+// The running server listens on a unix socket (-s). A new process started
+// with the same -s connects to it and gets every listening socket passed
+// over SCM_RIGHTS, then the old one drains and exits. No connection is
+// refused in between since the listening sockets never close.
+
+// payload byte per descriptor: 'T' listener, 'S' TLS listener, 'U' udp control socket
+int TakeOver(const char* path, int* listen_socks, int* listen_tls, int* num_listen, int* udp_sock){
+	struct sockaddr_un addr;
+	char kinds[MAX_LISTEN + 1];
+	int fds[MAX_LISTEN + 1];
+	int i, n = MAX_LISTEN + 1;
+	int s;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		Errx(MP_ADDR_ERR, "unix socket path too long: %s", path);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	s = Socket(AF_UNIX, SOCK_STREAM, 0);
+	if (connect(s, (struct sockaddr*) &addr, sizeof(addr))){
+		close(s);
+		return 0; // nobody to take over from
+	}
+
+	if (RecvFds(s, kinds, sizeof(kinds), fds, &n) < 0)
+		n = 0;
+	close(s);
+
+	FOR(i, n){
+		if (kinds[i] == 'U')
+			*udp_sock = fds[i];
+		else {
+			listen_tls[*num_listen] = kinds[i] == 'S';
+			listen_socks[(*num_listen)++] = fds[i];
+		}
+	}
+
+	Log("Took over %d sockets from %s\n", n, path);
+	return n;
+}
+
+void Handoff(int handoff_sock, const int* listen_socks, const int* listen_tls, int num_listen, int udp_sock){
+	char kinds[MAX_LISTEN + 1];
+	int fds[MAX_LISTEN + 1];
+	int i, n = 0;
+	int s = accept(handoff_sock, NULL, NULL);
+
+	if (s < 0){
+		Warnx("handoff accept: %s", strerror(errno));
+		return;
+	}
+
+	FOR(i, num_listen){
+		kinds[n] = listen_tls[i] ? 'S' : 'T';
+		fds[n++] = listen_socks[i];
+	}
+	if (udp_sock != -1){
+		kinds[n] = 'U';
+		fds[n++] = udp_sock;
+	}
+
+	if (SendFds(s, kinds, n, fds, n) >= 0)
+		Log("Handed off %d sockets\n", n);
+	close(s);
+}
+
+// LISTENERS
+
+// tcp_port, host:tcp_port, [ipv6]:tcp_port or unix:/path, tls: in front for https
+int Listener(const char* spec, int* tls){
+	char* host;
+	char* port;
+	struct stat st;
+	int s;
+
+	if ( (*tls = !strncmp(spec, "tls:", 4)) )
+		spec += 4;
+	host = MLC(char, strlen(spec) + 1);
+
+	if (!strncmp(spec, "unix:", 5)){
+		// stale socket left by a killed server
+		if (!stat(spec+5, &st) && S_ISSOCK(st.st_mode))
+			unlink(spec+5);
+		free(host);
+		s = UnixServer(spec+5, sockopts.backlog);
+		TuneListener(s, 0);
+		return s;
+	}
+
+	strcpy(host, spec);
+	if (host[0] == '['){
+		port = strchr(host, ']');
+		if (port == NULL || port[1] != ':')
+			Errx(MP_PARAM_ERR, "bad listen address %s", spec);
+		*port = 0;
+		port += 2;
+		s = PassiveSocket(host+1, port, SOCK_STREAM);
+	}
+	else if ( (port = strrchr(host, ':')) != NULL ){
+		*port++ = 0;
+		s = PassiveSocket(host, port, SOCK_STREAM);
+	}
+	else
+		s = PassiveSocket(NULL, host, SOCK_STREAM);
+
+	TuneListener(s, 1);
+	Listen(s, sockopts.backlog);
+
+	free(host);
+	return s;
+}
+
+int IsTCP(int socket){
+	struct sockaddr_storage addr;
+	socklen_t addrlen = sizeof(addr);
+	if (getsockname(socket, (struct sockaddr*) &addr, &addrlen))
+		return 0;
+	return addr.ss_family == AF_INET || addr.ss_family == AF_INET6;
+}
+
+// re-exec ourselves, the new process takes the sockets over through -s
+void Restart(char** argv, int start_dir, const char* handoff_path){
+	pid_t pid;
+
+	if (handoff_path == NULL){
+		Warnx("hot restart needs a handoff socket (-s)");
+		return;
+	}
+
+	if ((pid = Fork()) == 0){
+		if (fchdir(start_dir)) _exit(MP_RUNT_ERR);
+		closefrom(3);
+		execv("/proc/self/exe", argv);
+		_exit(MP_RUNT_ERR);
+	}
+
+	Log("Started new server, pid %d\n", (int) pid);
+}
+
 char* Status(int code){
     switch (code) {
+        case 100:
+            return "Continue";
         case 200:
             return "OK";
+        case 201:
+            return "Created";
+        case 301:
+            return "Moved Permanently";
+        case 302:
+            return "Found";
         case 400:
             return "Bad Request";
         case 403:
@@ -56,71 +308,420 @@ char* Status(int code){
             return "Not Found";
         case 405:
             return "Method Not Allowed";
+        case 409:
+            return "Conflict";
+        case 411:
+            return "Length Required";
+        case 413:
+            return "Content Too Large";
+        case 429:
+            return "Too Many Requests";
+        case 431:
+            return "Request Header Fields Too Large";
         case 500:
             return "Internal Server Error";
+        case 501:
+            return "Not Implemented";
+        case 502:
+            return "Bad Gateway";
+        case 504:
+            return "Gateway Timeout";
         default:
             return "";
     }
 }
 
-void WriteHeader(int socket, int code, int close_conn, int content_length, const char* type) {
+// DATE
+//
+// One Date header a second for all threads: the first one to notice the
+// second changed formats it under date_lock, the others copy it. Slots go
+// round every four seconds, so nobody is still copying the one rewritten.
+
+char date_slots[4][DATE_LEN + 1];
+time_t date_sec = 0;
+pthread_mutex_t date_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// "Date: ...\r\n" into out, DATE_LEN bytes and no NUL
+void HttpDate(char* out){
+	time_t now = time(NULL);
+	struct tm tm;
+
+	if (__atomic_load_n(&date_sec, __ATOMIC_ACQUIRE) != now){
+		pthread_mutex_lock(&date_lock);
+		if (date_sec != now){
+			gmtime_r(&now, &tm);
+			strftime(date_slots[now & 3], DATE_LEN + 1, "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm);
+			__atomic_store_n(&date_sec, now, __ATOMIC_RELEASE);
+		}
+		pthread_mutex_unlock(&date_lock);
+	}
+	memcpy(out, date_slots[now & 3], DATE_LEN);
+}
+
+// CANNED RESPONSES
+//
+// Error pages are the same bytes every time but for Date, and so is a
+// redirect but for Location. They are serialized once at start and go out
+// in a single writev() of the pieces; scanners asking for what isn't there
+// shouldn't cost more than real hits.
+
+#define CANNED_FIRST 400
+#define CANNED_LAST  599
+
+typedef struct {
+	char* status;       // "HTTP/1.1 404 Not Found\r\n", NULL if not built
+	int status_len;
+	char* rest[2];      // headers after Date and the body, keep alive and close
+	int head_len[2];    // of rest, without the body
+	int len[2];
+	char* body;         // on its own for HTTP/2
+	int body_len;
+} canned;
+
+canned canned_errors[CANNED_LAST - CANNED_FIRST + 1];
+canned canned_redirect;
+
+void CannedBuild(canned* k, int code, int has_body){
+	char line[BUFFER_LEN_SMALL];
+	int i;
+
+	sprintf(line, "HTTP/1.1 %d %s\r\n", code, Status(code));
+	k->status = strdup(line);
+	k->status_len = strlen(line);
+	k->body_len = has_body ? sprintf(line, "<html><body><h1>%d %s</h1></body></html>", code, Status(code)) : 0;
+	k->body = strndup(line, k->body_len);
+
+	FOR(i, 2){
+		k->head_len[i] = sprintf(line, "Content-Length: %d\r\n%sConnection: %s\r\n\r\n", k->body_len,
+			has_body ? "Content-Type: text/html\r\n" : "", i ? "close" : "keep alive");
+		k->len[i] = k->head_len[i] + k->body_len;
+		k->rest[i] = MLC(char, k->len[i]);
+		memcpy(k->rest[i], line, k->head_len[i]);
+		memcpy(k->rest[i] + k->head_len[i], k->body, k->body_len);
+	}
+}
+
+// errors with a reason phrase, and the redirect
+void CannedInit(){
+	int code;
 
-	char* buff = MLC(char, BUFFER_LEN);
+	for (code = CANNED_FIRST; code <= CANNED_LAST; code++){
+		if (Status(code)[0])
+			CannedBuild(canned_errors + code - CANNED_FIRST, code, 1);
+	}
+	CannedBuild(&canned_redirect, 301, 0);
+}
+
+// status line and headers into buff (BUFFER_LEN), returns the length;
+// content_length -1 means a chunked body
+int FormatHeader(char* buff, int code, int close_conn, int content_length, const char* type){
+
+	int len = sprintf(buff, "HTTP/1.1 %d %s\r\n", code, Status(code));
+
+	HttpDate(buff + len);
+	len += DATE_LEN;
+
+	if ( content_length >= 0 )
+		len += sprintf(buff+len, "Content-Length: %d\r\n", content_length);
+	else
+		len += sprintf(buff+len, "Transfer-Encoding: chunked\r\n");
+
+	if ( type != NULL )
+		len += sprintf(buff+len, "Content-Type: %s\r\n", type);
+
+	if ( close_conn == 0 && draining )
+		close_conn = 1;
+
+	if ( close_conn != -1 )
+		len += sprintf(buff+len, "Connection: %s\r\n",  close_conn ? "close" : "keep alive");
+
+	len += sprintf(buff+len, "\r\n");
+	return len;
+}
+
+// whole header goes out in one write (one TLS record)
+void WriteHeader(client* c, int code, int close_conn, int content_length, const char* type) {
+
+	char* buff;
 	char* status = Status(code);
 
-	sprintf(buff, "HTTP/1.1 %d %s\r\n", code, status);
-	Writen(socket, buff, strlen(buff));
+	TraceFirstByte(&c->trace, c->socket, code);
+	if (c->stream != NULL){
+		H2WriteHeader(c->stream, code, content_length, type, NULL, NULL);
+		Log("%s <- [%d %s] h2\n", c->ip, code, status);
+		return;
+	}
+
+	buff = PoolGet(&buffer_pool);
+	ClientWrite(c, buff, FormatHeader(buff, code, close_conn, content_length, type));
+	PoolPut(&buffer_pool, buff);
+
+	Log("%s <- [%d %s]\n", c->ip, code, status);
+}
+
+// header and an in-memory body, one writev() on plain sockets
+void WriteResponse(client* c, int code, int close_conn, int content_length, const char* type, const void* body){
+
+	struct iovec iov[2];
+	char* buff;
+
+	if (c->head){
+		WriteHeader(c, code, close_conn, content_length, type);
+		return;
+	}
+
+	if (c->stream != NULL || c->ssl != NULL){
+		WriteHeader(c, code, close_conn, content_length, type);
+		ClientWrite(c, body, content_length);
+		return;
+	}
+
+	TraceFirstByte(&c->trace, c->socket, code);
+	buff = PoolGet(&buffer_pool);
+	iov[0].iov_base = buff;
+	iov[0].iov_len = FormatHeader(buff, code, close_conn, content_length, type);
+	iov[1].iov_base = (void*) body;
+	iov[1].iov_len = content_length;
+	Writevn(c->socket, iov, 2);
+	PoolPut(&buffer_pool, buff);
+
+	Log("%s <- [%d %s]\n", c->ip, code, Status(code));
+}
+
+// k with Date, and Location if it isn't NULL
+void WriteCanned(client* c, int code, const canned* k, int close_conn, const char* location){
+	struct iovec iov[6];
+	char date[DATE_LEN];
+	char* buff;
+	int i, n = 0, len = 0;
 
-	if ( content_length ){
-		sprintf(buff, "Content-Length: %d\r\n", content_length);
-		Writen(socket, buff, strlen(buff));
+	TraceFirstByte(&c->trace, c->socket, code);
+	if (c->stream != NULL){
+		H2WriteHeader(c->stream, code, k->body_len, k->body_len > 0 ? "text/html" : NULL, location, NULL);
+		if (!c->head && k->body_len > 0)
+			ClientWrite(c, k->body, k->body_len);
+		Log("%s <- [%d %s] h2\n", c->ip, code, Status(code));
+		return;
 	}
 
-	if ( type != NULL ){
-		sprintf(buff, "Content-Type: %s\r\n", type);
-		Writen(socket, buff, strlen(buff));
+	close_conn = close_conn || draining;
+	HttpDate(date);
+	iov[n].iov_base = k->status;
+	iov[n++].iov_len = k->status_len;
+	iov[n].iov_base = date;
+	iov[n++].iov_len = DATE_LEN;
+	if (location != NULL){
+		iov[n].iov_base = "Location: ";
+		iov[n++].iov_len = 10;
+		iov[n].iov_base = (void*) location;
+		iov[n++].iov_len = strlen(location);
+		iov[n].iov_base = "\r\n";
+		iov[n++].iov_len = 2;
 	}
+	iov[n].iov_base = k->rest[close_conn];
+	iov[n++].iov_len = c->head ? k->head_len[close_conn] : k->len[close_conn];
 
-	if ( close_conn != -1 ){
-		sprintf(buff, "Connection: %s\r\n",  close_conn ? "close" : "keep alive");
-		Writen(socket, buff, strlen(buff));
+	if (c->ssl == NULL)
+		Writevn(c->socket, iov, n);
+	else {
+		// one TLS record
+		buff = PoolGet(&buffer_pool);
+		FOR(i, n){
+			memcpy(buff + len, iov[i].iov_base, iov[i].iov_len);
+			len += iov[i].iov_len;
+		}
+		ClientWrite(c, buff, len);
+		PoolPut(&buffer_pool, buff);
 	}
 
-	Writen(socket, "\r\n", 2);
+	Log("%s <- [%d %s]\n", c->ip, code, Status(code));
+}
+
+void HttpErrorConn(client* c, int code, int close_conn){
+	char* buff;
+	int len;
 
-	char* ip = GetClientInfo(socket, NULL);
-	Log("%s <- [%d %s]\n", ip, code, status);
-	free(ip);
+	if (code >= CANNED_FIRST && code <= CANNED_LAST && canned_errors[code - CANNED_FIRST].status != NULL){
+		WriteCanned(c, code, canned_errors + code - CANNED_FIRST, close_conn, NULL);
+		return;
+	}
+	buff = PoolGet(&small_pool);
+	len = sprintf(buff, "<html><body><h1>%d %s</h1></body></html>", code, Status(code));
+	WriteResponse(c, code, close_conn, len, "text/html", buff);
+	PoolPut(&small_pool, buff);
 }
 
-void HttpError(int client, int code){
+void HttpError(client* c, int code){
 	// if server error, close connection
-	int close_conn = code == 500;
+	HttpErrorConn(c, code, code == 500);
+}
 
-	char* buff = MLC(char, 50);
-	sprintf(buff, "<html><body><h1>%d %s</h1></body></html>", code, Status(code));
-	int len = strlen(buff);
-	WriteHeader(client, code, close_conn, len, "text/html");
-	Writen(client, buff, len);
-	free(buff);
+// 301 to the directory path with its slash; path is decoded, query the
+// raw query string or NULL
+void Redirect(client* c, const char* path, const char* query){
+	char* location = PoolGet(&buffer_pool);
+	const char* p;
+	int len = 0;
+
+	for (p = path; *p && len < BUFFER_LEN / 2; p++){
+		if (isalnum((byte) *p) || strchr("/-._~!$&'()*+,;=:@", *p))
+			location[len++] = *p;
+		else
+			len += sprintf(location + len, "%%%02X", (byte) *p);
+	}
+	location[len++] = '/';
+	if (query != NULL){
+		location[len++] = '?';
+		// already encoded, but not trusted to be free of CR LF
+		for (p = query; *p && *p != '#' && len < BUFFER_LEN - 4; p++){
+			if (*p > ' ' && *p < 0x7f)
+				location[len++] = *p;
+			else
+				len += sprintf(location + len, "%%%02X", (byte) *p);
+		}
+	}
+	location[len] = 0;
+
+	WriteCanned(c, 301, &canned_redirect, 0, location);
+	PoolPut(&buffer_pool, location);
+}
+
+int StartTls(client* c){
+	if ( (c->ssl = TlsAccept(c->socket)) == NULL )
+		return 0;
+
+	c->ktls = TlsKernelSend(c->ssl);
+	Log("%s TLS %s%s%s\n", c->ip, SSL_get_version(c->ssl),
+		SSL_session_reused(c->ssl) ? " resumed" : "",
+		c->ktls ? " ktls" : "");
+	return 1;
+}
+
+// value of a request header, NULL if it's not there
+char* HeaderValue(const char* request, const char* name){
+	size_t len = strlen(name);
+	const char* line = strstr(request, "\r\n");
+	const char* end;
+	char* value;
+
+	while (line != NULL && strncmp(line, "\r\n\r\n", 4)){
+		line += 2;
+		if (!strncasecmp(line, name, len) && line[len] == ':'){
+			for (line += len + 1; *line == ' ' || *line == '\t'; line++);
+			if ( (end = strstr(line, "\r\n")) == NULL )
+				end = line + strlen(line);
+			value = MLC(char, end - line + 1);
+			memcpy(value, line, end - line);
+			value[end - line] = 0;
+			return value;
+		}
+		line = strstr(line, "\r\n");
+	}
+	return NULL;
+}
+
+// HTTP/1.1 and HTTP/2 requests both end up here, uploads only on HTTP/1.1
+void HandleRequest(client* c, const char* method, char* path){
+	proxy_route* pr;
+	fcgi_route* fr = NULL;
+	char* head;
+
+	if (c->stream != NULL && (!strcasecmp(method, "PUT") || !strcasecmp(method, "POST"))){
+		HttpError(c, 501);
+		return;
+	}
+	// HTTP/1.1 got to these before, here they are HTTP/2 streams
+	if ( (pr = ProxyFind(path)) != NULL || (fr = FcgiFind(path)) != NULL ){
+		if ( (head = H2RequestHead(c->stream, method, path)) == NULL )
+			HttpError(c, 431);
+		else if (pr != NULL)
+			Proxy(c, pr, method, head, strlen(head), path);
+		else
+			Fcgi(c, fr, method, head, strlen(head), path);
+		free(head);
+		return;
+	}
+	if (strcasecmp(method, "GET") && strcasecmp(method, "HEAD")){
+		HttpError(c, 405);
+		return;
+	}
+	if (!LimitRequest(c)){
+		Log("%s -> %s %s rate limited\n", c->ip, method, path);
+		HttpError(c, 429);
+		return;
+	}
+	Log("%s -> %s %s%s\n", c->ip, method, path, c->stream != NULL ? " h2" : "");
+	c->head = !strcasecmp(method, "HEAD");
+	Get(c, path);
+	c->head = 0;
+}
+
+// Upgrade: h2c, answers 101 and returns 1 if the connection switched
+int UpgradeH2(client* c, const char* request, int req_len, const char* path){
+	char* upgrade = HeaderValue(request, "Upgrade");
+	char* settings = HeaderValue(request, "HTTP2-Settings");
+	const char* body = strstr(request, "\r\n\r\n");
+	const char* resp = "HTTP/1.1 101 Switching Protocols\r\n"
+		"Connection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+	int ok = c->ssl == NULL && upgrade != NULL && settings != NULL &&
+		body != NULL && strstr(upgrade, "h2c") != NULL;
+
+	if (ok){
+		Log("%s -> GET %s upgrade h2c\n", c->ip, path);
+		ClientWrite(c, resp, strlen(resp));
+		body += 4;
+		H2Serve(c, HandleRequest, (const byte*) body, request + req_len - body,
+			path, settings);
+	}
+
+	free(upgrade);
+	free(settings);
+	return ok;
 }
 
 void* ProcessClient(void* args){
-	int i,j, socket = *((int*) args);
-	char* path = MLC(char, BUFFER_LEN_SMALL);
-	char* request = MLC(char, BUFFER_LEN);
-	int req_len;
-	char* ip = GetClientInfo(socket, NULL);
+	client* c = (client*) args;
+	int i,j, socket = c->socket;
+	char* path = NULL;
+	char* request = NULL;
+	char method[METHOD_LEN];
+	int req_len, keepalive;
+	proxy_route* pr;
+	fcgi_route* fr;
 
-	SetTimeout(socket, WAIT_SECS, 0);
+	SetTimeout(socket, Conf()->timeout, 0);
+	PaceStart(c, IsTCP(socket));
 
-	while(1){
-		memset(request, 0, BUFFER_LEN);
-		req_len = Recv(socket, request, BUFFER_LEN, 0);
+	int ok = !c->tls || StartTls(c);
+
+	// h2 negotiated through ALPN
+	if (ok && c->ssl != NULL && TlsIsH2(c->ssl)){
+		H2Serve(c, HandleRequest, NULL, 0, NULL, NULL);
+		ok = 0;
+	}
+
+	while(ok && SetBusy(c, 0)){
+		// buffers only while a request is in, idle keep-alive holds none
+		PoolPut(&buffer_pool, request);
+		PoolPut(&small_pool, path);
+		request = path = NULL;
+		keepalive = Conf()->keepalive;
+		ConfPut(); // nor a configuration snapshot
+
+		if ( (req_len = ClientWait(c, keepalive)) == 0 ){
+			errno = EWOULDBLOCK;
+			req_len = -1;
+		}
+		else if (req_len > 0){
+			request = PoolGet(&buffer_pool);
+			path = PoolGet(&small_pool);
+			memset(request, 0, BUFFER_LEN);
+			req_len = ClientRead(c, request, BUFFER_LEN - 1);
+		}
 
 		if (req_len < 0){
 			if (errno == EWOULDBLOCK)
-				Log("No requests for %d seconds, exiting client thread\n", WAIT_SECS);
+				Log("No requests for %d seconds, exiting client thread\n", keepalive);
 			else
 				Warnx("recv: %s\n", strerror(errno));
 			break;
@@ -128,77 +729,191 @@ void* ProcessClient(void* args){
 		else if (req_len == 0)
 			break;
 
-		if (!strncmp(request, "GET", 3) || !strncmp(request, "get", 3)){
+		SetBusy(c, 1);
+		TraceStart(&c->trace);
 
-			if (req_len < 4){
-				HttpError(socket, 400);
-				continue;
-			}
+		// h2c with prior knowledge
+		if (req_len >= H2_PREFACE_LEN && !memcmp(request, H2_PREFACE, H2_PREFACE_LEN)){
+			H2Serve(c, HandleRequest, (const byte*) request, req_len, NULL, NULL);
+			break;
+		}
 
-			for(i=3; i<req_len && isspace(request[i]) ; i++);
-			for(j=0; i<req_len && !isspace(request[i]); i++)
-				path[j++] = request[i];
+		// request line: method path version
+		for(i=0; i<req_len && !isspace(request[i]) && i<METHOD_LEN-1; i++)
+			method[i] = request[i];
+		method[i] = 0;
+		for(; i<req_len && !isspace(request[i]); i++);
+		for(; i<req_len && isspace(request[i]) ; i++);
+		for(j=0; i<req_len && !isspace(request[i]) && j<BUFFER_LEN_SMALL-1; i++)
+			path[j++] = request[i];
+		path[j]=0;
 
-			if (j==0){
-				HttpError(socket, 400);
-				continue;
-			}
+		if (method[0] == 0 || j == 0){
+			HttpError(c, 400);
+			continue;
+		}
 
-			path[j]=0;
-			Log("%s -> GET %s\n", ip, path);
-			Get(socket, path);
+		TraceMark(&c->trace, TRACE_PARSED);
+		PROBE3(parsed, socket, method, path);
 
-		} else
-			HttpError(socket, 405);
+		c->host = HeaderValue(request, "Host");
+		if ( (pr = ProxyFind(path)) != NULL )
+			ok = Proxy(c, pr, method, request, req_len, path);
+		else if ( (fr = FcgiFind(path)) != NULL )
+			ok = Fcgi(c, fr, method, request, req_len, path);
+		else if (!strcasecmp(method, "PUT") || !strcasecmp(method, "POST"))
+			ok = Put(c, method, request, req_len, path);
+		else if (!strcasecmp(method, "GET") && UpgradeH2(c, request, req_len, path))
+			ok = 0;
+		else
+			HandleRequest(c, method, path);
+		TraceEnd(&c->trace, socket, c->ip, method, path);
+		free(c->host);
+		c->host = NULL;
 	}
 
+	if (c->ssl != NULL)
+		TlsClose(c->ssl);
+	free(c->host);
+	// out of clients[] first, Drain() mustn't shutdown() a reused fd
+	RemoveClient(c);
 	Close(socket);
-	free(ip);
-	free(request);
-	free(path);
+	PoolPut(&buffer_pool, request);
+	PoolPut(&small_pool, path);
 	pthread_exit(0);
 }
 
+#ifndef MOJWEB_NO_MAIN // bench/micro.c brings its own
+// a numeric command line option, "1M" or "-1" is an error
+long long OptNumber(int opt, const char* value, long long max){
+	long long n;
+
+	if (!ParseNumber(value, max, &n))
+		Errx(MP_PARAM_ERR, "-%c %s is not a number from 0 to %lld", opt, value, max);
+	return n;
+}
+
 int main(int argc, char** argv){
 
 	char* tcp_port = MLC(char, PORT_LEN);
 	char* root_dir = MLC(char, PATH_LEN);
 	char* udp_port = NULL;
-	char* ip;
+	char* handoff_path = NULL;
+	char* manifest = NULL;
+	char* conf_path = NULL;
+	char* cert = NULL;
+	char* key = NULL;
+	char* listen_specs[MAX_LISTEN];
+	int num_specs = 0;
+	char* ptr;
 	int s, make_daemon = 0;
+	int start_dir;
 	char ch;
 
 	// connection
-	int tcp_sock = -1;
+	int listen_socks[MAX_LISTEN];
+	int listen_tcp[MAX_LISTEN];
+	int listen_tls[MAX_LISTEN];
+	int num_listen = 0;
 	int udp_sock = -1;
-	int max_sock = -1;
-	fd_set sockets, tmp;
+	int handoff_sock = -1;
+	int handed_off = 0;
+	int max_sock;
+	fd_set sockets;
 
 	// client
 	int client_sock;
-	struct sockaddr client;
-	socklen_t client_len;
-
-	// threads
-	int num_threads = 0;
-	pthread_t tids[MAX_THREAD];
+	client* c;
+	config* cf;
+	sigset_t block, old_mask;
+	pthread_attr_t attr;
+	pthread_t tid;
 
 	// init options
 	strcpy(root_dir, ROOT_DEFAULT);
-	while ( (ch=getopt(argc, argv, "dr:")) != -1 ){
+	while ( (ch=getopt(argc, argv, "a:b:c:dF:f:k:l:m:o:p:r:R:s:t:u:v:w:")) != -1 ){
 		switch (ch) {
+			case 'a':
+				ParseCpus(optarg);
+				break;
+			case 'b':
+				default_host.bundle = BundleRoot(optarg);
+				break;
+			case 'c':
+				cert = optarg;
+				break;
 			case 'd':
 				make_daemon = 1;
 				break;
+			case 'F':
+				FcgiAdd(optarg);
+				break;
+			case 'f':
+				// read again on SIGHUP, after we chdir()ed
+				if ( (conf_path = realpath(optarg, NULL)) == NULL )
+					Error(optarg);
+				break;
+			case 'k':
+				key = optarg;
+				break;
+			case 'l':
+				if (num_specs == MAX_LISTEN)
+					Errx(MP_PARAM_ERR, "at most %d listen addresses", MAX_LISTEN);
+				listen_specs[num_specs++] = optarg;
+				break;
+			case 'm':
+				conf_boot.cache_max = OptNumber(ch, optarg, LLONG_MAX);
+				break;
+			case 'o':
+				ParseSockOpt(optarg);
+				break;
+			case 'p':
+				ProxyAdd(optarg);
+				break;
 			case 'r':
 				strcpy(root_dir, optarg);
 				break;
+			case 'R':
+				ParseLimit(optarg);
+				break;
+			case 't':
+				trace_every = OptNumber(ch, optarg, INT_MAX);
+				break;
+			case 'u':
+				conf_boot.max_upload = OptNumber(ch, optarg, LLONG_MAX);
+				break;
+			case 's':
+				handoff_path = optarg;
+				break;
+			case 'v':
+				VhostAdd(optarg);
+				break;
+			case 'w':
+				// we chdir() to the root before reading it
+				if ( (manifest = realpath(optarg, NULL)) == NULL )
+					Error(optarg);
+				break;
 			default:
 				Usage(argv[0]);
 		}
 	}
 
+	conf_boot.sock = sockopts;
+	if (conf_path != NULL){
+		if ( (cf = ConfLoad(conf_path)) == NULL )
+			Errx(MP_PARAM_ERR, "can't start with %s", conf_path);
+		ConfSwap(cf);
+		FOR(s, cf->num_listen){
+			if (num_specs == MAX_LISTEN)
+				Errx(MP_PARAM_ERR, "at most %d listen addresses", MAX_LISTEN);
+			listen_specs[num_specs++] = cf->listen[s];
+		}
+	}
+
 	CheckRootDir(root_dir);
+	CannedInit();
+	LimitInit();
+	CpuInit();
 
 	switch (argc - optind) {
 		case 0:
@@ -214,13 +929,43 @@ int main(int argc, char** argv){
 			Usage(argv[0]);
 	}
 
+	if ( (start_dir = open(".", O_RDONLY)) == -1 ) Error("open .");
 	if (chdir(root_dir)) Error("chdir");
+	default_host.path = getcwd(NULL, 0);
+	if ( (default_host.root_fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1 ) Error("open root");
 
-	if (udp_port != NULL)
+	if (handoff_path != NULL){
+		TakeOver(handoff_path, listen_socks, listen_tls, &num_listen, &udp_sock);
+		unlink(handoff_path);
+		handoff_sock = UnixServer(handoff_path, 1);
+	}
+
+	if (udp_port != NULL && udp_sock == -1)
 		udp_sock = TurnOn(udp_port);
 
-	tcp_sock = TCPserver(tcp_port, BACKLOG);
-	max_sock = MAX(udp_sock, tcp_sock);
+	if (num_listen == 0 && num_specs == 0)
+		listen_socks[num_listen++] = Listener(tcp_port, listen_tls);
+	else if (num_listen == 0){
+		FOR(s, num_specs){
+			listen_socks[num_listen] = Listener(listen_specs[s], listen_tls + num_listen);
+			num_listen++;
+		}
+	}
+	else {
+		// taken over listeners keep their address, listen() again resizes the backlog
+		FOR(s, num_listen){
+			TuneListener(listen_socks[s], IsTCP(listen_socks[s]));
+			Listen(listen_socks[s], sockopts.backlog);
+		}
+	}
+	FOR(s, num_listen){
+		listen_tcp[s] = IsTCP(listen_socks[s]);
+		if (listen_tls[s] && tls_ctx == NULL){
+			if (cert == NULL || key == NULL)
+				Errx(MP_PARAM_ERR, "tls listener needs -c cert and -k key");
+			TlsInit(cert, key);
+		}
+	}
 
 	if (make_daemon){
 		Log("Daemonizing\n");
@@ -228,55 +973,151 @@ int main(int argc, char** argv){
 		openlog("fh47758:mrepro mojweb", LOG_PID, LOG_LOCAL0);
 	}
 
-	FD_ZERO(&sockets);
-	if (tcp_sock != -1) FD_SET(tcp_sock, &sockets);
-	if (udp_sock != -1) FD_SET(udp_sock, &sockets);
+	if (manifest != NULL)
+		Warm(manifest);
 
-	while(1){
+	if (pipe(wake_pipe)) Error("pipe");
+	fcntl(wake_pipe[1], F_SETFL, O_NONBLOCK);
+	Signal(SIGTERM, OnSignal);
+	Signal(SIGINT, OnSignal);
+	Signal(SIGUSR2, OnSignal);
+	Signal(SIGUSR1, OnSignal);
+	Signal(SIGHUP, OnSignal);
+	Signal(SIGPIPE, SIG_IGN);
 
-        if (num_threads >= MAX_THREAD){
-            FD_CLR(tcp_sock, &sockets);
-            Close(tcp_sock);
-        }
+	// client threads leave signals to main
+	sigemptyset(&block);
+	sigaddset(&block, SIGTERM);
+	sigaddset(&block, SIGINT);
+	sigaddset(&block, SIGUSR2);
+	sigaddset(&block, SIGUSR1);
+	sigaddset(&block, SIGHUP);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
 
-		tmp = sockets;
+	while(!draining){
 
-		if (select(max_sock+1, &sockets, NULL, NULL, NULL) == -1)
+		FD_ZERO(&sockets);
+		max_sock = wake_pipe[0];
+		FD_SET(wake_pipe[0], &sockets);
+		if (udp_sock != -1){
+			FD_SET(udp_sock, &sockets);
+			max_sock = MAX(max_sock, udp_sock);
+		}
+		if (handoff_sock != -1){
+			FD_SET(handoff_sock, &sockets);
+			max_sock = MAX(max_sock, handoff_sock);
+		}
+		// at max_clients stop accepting until one exits
+		if (num_clients < conf->max_clients){
+			FOR(s, num_listen){
+				FD_SET(listen_socks[s], &sockets);
+				max_sock = MAX(max_sock, listen_socks[s]);
+			}
+		}
+
+		if (select(max_sock+1, &sockets, NULL, NULL, NULL) == -1){
+			if (errno == EINTR) continue;
 			Error("select");
+		}
 
-		for (s = 0; s <= max_sock; s++) {
-			if (!FD_ISSET(s, &sockets))
-				continue;
-			if (s==udp_sock){
-				if (TurnOff(udp_sock))
+		if (FD_ISSET(wake_pipe[0], &sockets)){
+			read(wake_pipe[0], &ch, 1);
+			while (waitpid(-1, NULL, WNOHANG) > 0); // restarted children
+			if (ch == 'D')
+				Drain();
+			else if (ch == 'R')
+				Restart(argv, start_dir, handoff_path);
+			else if (ch == 'T')
+				TraceDump();
+			else if (ch == 'H')
+				ConfReload(conf_path);
+			ConfReclaim();
+		}
+
+		if (udp_sock != -1 && FD_ISSET(udp_sock, &sockets)){
+			switch (TurnOff(udp_sock)) {
+				case CTL_OFF:
+					Drain();
+					break;
+				case CTL_RESTART:
+					Restart(argv, start_dir, handoff_path);
 					break;
-			}
-			if (s==tcp_sock){
-				client_sock = Accept(tcp_sock, &client, &client_len);
-				ip = GetClientInfo(client_sock, NULL);
-				Log("New client: %s\n", ip);
-				free(ip);
-				pthread_create(tids + num_threads++, NULL, ProcessClient, (void*) &client_sock);
 			}
 		}
 
-		// check if udp got OFF
-		if (s<=max_sock) break;
+		if (handoff_sock != -1 && FD_ISSET(handoff_sock, &sockets)){
+			Handoff(handoff_sock, listen_socks, listen_tls, num_listen, udp_sock);
+			handed_off = 1;
+			Drain();
+		}
+
+		FOR(s, num_listen){
+			if (draining || !FD_ISSET(listen_socks[s], &sockets))
+				continue;
+
+			client_sock = accept(listen_socks[s], NULL, NULL);
+			if (client_sock == -1){
+				Warnx("accept: %s", strerror(errno));
+				continue;
+			}
+			fcntl(client_sock, F_SETFD, FD_CLOEXEC);
+			TuneClient(client_sock, listen_tcp[s]);
 
-		sockets = tmp;
+			if ((c = AddClient(client_sock, listen_tls[s])) == NULL){
+				Close(client_sock);
+				continue;
+			}
+			if (!LimitConnect(c)){
+				Log("Too many connections from %s\n", c->ip);
+				RemoveClient(c);
+				Close(client_sock);
+				continue;
+			}
+			Log("New client: %s\n", c->ip);
+			PROBE2(accept, client_sock, c->ip);
+
+			PlaceThread(&attr, client_sock);
+			pthread_sigmask(SIG_BLOCK, &block, &old_mask);
+			if (pthread_create(&tid, &attr, ProcessClient, (void*) c)){
+				Warnx("pthread_create: %s", strerror(errno));
+				RemoveClient(c);
+				Close(client_sock);
+			}
+			pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+		}
+	}
+
+	// stop accepting; plain close, a new process may share these sockets
+	FOR(s, num_listen)
+		close(listen_socks[s]);
+	if (udp_sock != -1)
+		close(udp_sock);
+	if (handoff_sock != -1){
+		close(handoff_sock);
+		if (!handed_off)
+			unlink(handoff_path);
+	}
+	FOR(s, num_specs){
+		ptr = listen_specs[s] + (strncmp(listen_specs[s], "tls:", 4) ? 0 : 4);
+		if (!handed_off && !strncmp(ptr, "unix:", 5))
+			unlink(ptr+5);
 	}
 
 	Log("Waiting for threads to finish\n");
 
 	// wait for clients
-	for(s=0;s<num_threads;s++)
-		pthread_join(tids[s],NULL);
+	WaitClients();
 
 	Log("Threads done, exiting\n");
 
 	// release resources
-	Close(tcp_sock);
+	pthread_attr_destroy(&attr);
+	close(start_dir);
+	close(default_host.root_fd);
 	free(root_dir);
 	free(tcp_port);
+	free(udp_port);
 	return 0;
 }
+#endif // MOJWEB_NO_MAIN
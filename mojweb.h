@@ -1,4 +1,16 @@
+#ifdef __linux__
+#define _GNU_SOURCE // thread affinity
+#endif
 #include "mrepro.h"
+#include "tls.h"
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/openat2.h>  // RESOLVE_BENEATH
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>  // SIOCOUTQ
+#endif
 
 #define PORT_DEFAULT "80"
 #define ROOT_DEFAULT "." // current directory
@@ -6,14 +18,542 @@
 #define MAX_THREAD   256
 #define WAIT_SECS    300 // wait 300 seconds
 #define DEFAULT_TYPE "application/octet-stream"
+#define MAX_LISTEN   16  // listening sockets handed over on hot restart
+#define BACKLOG_DEFAULT 511
+#define VHOST_BUCKETS 64
+#define METHOD_LEN   16
+#define DATE_LEN     37  // "Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
 
 void Usage(const char* name){
-    Errx(MP_PARAM_ERR, "%s [-d] [-r root_dir] [tcp_port [udp_port]]", name);
+    Errx(MP_PARAM_ERR, "%s [-d] [-f config_file] [-l [tls:]addr]... [-o sockopt=value]... [-R limit=value]... [-a cpu_list|rx]... [-b bundle.zip] [-c cert -k key] [-m mmap_max_bytes] [-p prefix=host:port]... [-F prefix|*.ext=host:port|unix:path]... [-r root_dir] [-u max_upload_bytes] [-w warm_manifest] [-v host=dir_or_zip[,index]]... [-s handoff_sock] [-t trace_every] [tcp_port [udp_port]]", name);
+}
+
+// SOCKET OPTIONS
+
+// listener and accepted socket tuning, 0 leaves the kernel default
+typedef struct {
+    int backlog;
+    int defer_accept;   // seconds to wait for request data before accept()
+    int fastopen;       // TFO queue length
+    int nodelay;
+    int sndbuf;
+    int rcvbuf;
+    int notsent_lowat;
+} sock_opts;
+
+// main's, -o and then the configuration file
+sock_opts sockopts = { BACKLOG_DEFAULT, 0, 0, 1, 0, 0, 0 };
+
+struct {
+    char* name;
+    size_t offset;
+} sockopt_names [] = {
+    { "backlog",        offsetof(sock_opts, backlog)        },
+    { "defer_accept",   offsetof(sock_opts, defer_accept)   },
+    { "fastopen",       offsetof(sock_opts, fastopen)       },
+    { "nodelay",        offsetof(sock_opts, nodelay)        },
+    { "sndbuf",         offsetof(sock_opts, sndbuf)         },
+    { "rcvbuf",         offsetof(sock_opts, rcvbuf)         },
+    { "notsent_lowat",  offsetof(sock_opts, notsent_lowat)  },
+    { 0,                0                                   }
+};
+
+// s as a whole number from 0 to max into *value, 0 if it is anything else
+int ParseNumber(const char* s, long long max, long long* value){
+    char* end;
+
+    errno = 0;
+    *value = strtoll(s, &end, 10);
+    return end != s && *end == 0 && errno == 0 && *value >= 0 && *value <= max;
+}
+
+// len bytes of name, 0 if there is no such option, -1 if value isn't a
+// count
+int SockOptSet(sock_opts* so, const char* name, int len, const char* value){
+    long long n;
+    int i;
+
+    for ( i = 0; sockopt_names[i].name; i++ ){
+        if ( strlen(sockopt_names[i].name) == len &&
+             !strncmp(name, sockopt_names[i].name, len) ){
+            if (!ParseNumber(value, INT_MAX, &n))
+                return -1;
+            *(int*) ((byte*) so + sockopt_names[i].offset) = n;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// name=value
+void ParseSockOpt(const char* opt){
+    const char* eq = strchr(opt, '=');
+    int ret;
+
+    if (eq == NULL)
+        Errx(MP_PARAM_ERR, "socket option %s needs a value", opt);
+    if ( (ret = SockOptSet(&sockopts, opt, eq - opt, eq + 1)) == 0 )
+        Errx(MP_PARAM_ERR, "unknown socket option %s", opt);
+    if (ret < 0)
+        Errx(MP_PARAM_ERR, "socket option %s is not a number from 0 to %d", opt, INT_MAX);
+}
+
+// before listen(): receive buffer has to be known for window scaling
+void TuneListener(int socket, int tcp){
+    SetBufSize(socket, 0, sockopts.rcvbuf);
+    if (!tcp) return;
+    if (sockopts.defer_accept) SetDeferAccept(socket, sockopts.defer_accept);
+    if (sockopts.fastopen)     SetFastOpen(socket, sockopts.fastopen);
+}
+
+void TuneClient(int socket, int tcp){
+    SetBufSize(socket, sockopts.sndbuf, 0);
+    if (!tcp) return;
+    SetNoDelay(socket, sockopts.nodelay);
+    if (sockopts.notsent_lowat) SetNotSentLowat(socket, sockopts.notsent_lowat);
+}
+
+// CPU PLACEMENT
+//
+// -a 0-3,8 pins client threads round robin to the listed CPUs, -a rx puts
+// each one on the CPU that received its first packets (SO_INCOMING_CPU),
+// where the NIC queue already has its state warm; both together keep rx
+// to the list. A pinned thread touches its stack and pool slabs first, so
+// the kernel places them on the CPU's node.
+
+#ifdef __linux__
+int cpus[CPU_SETSIZE];
+int num_cpus = 0;
+int next_cpu = 0;       // round robin, main thread only
+int follow_rx = 0;
+cpu_set_t all_cpus;     // unplaced threads get the mask main started with
+
+// "rx" or a list like 0-3,8,10-11
+void ParseCpus(const char* list){
+    char* end;
+    long from, to;
+
+    if (!strcmp(list, "rx")){
+        follow_rx = 1;
+        return;
+    }
+    while (*list){
+        from = to = strtol(list, &end, 10);
+        if (end == list)
+            Errx(MP_PARAM_ERR, "bad cpu list at %s", list);
+        if (*end == '-'){
+            list = end + 1;
+            to = strtol(list, &end, 10);
+            if (end == list)
+                Errx(MP_PARAM_ERR, "bad cpu list at %s", list);
+        }
+        if (from < 0 || to < from || to >= CPU_SETSIZE)
+            Errx(MP_PARAM_ERR, "bad cpu range %ld-%ld", from, to);
+        for (; from <= to && num_cpus < CPU_SETSIZE; from++)
+            cpus[num_cpus++] = from;
+        list = end + (*end == ',');
+        if (*end != ',' && *end != 0)
+            Errx(MP_PARAM_ERR, "bad cpu list at %s", end);
+    }
+}
+
+// CPU for the client on socket, -1 to leave it to the scheduler
+int PickCpu(int socket){
+    int i, cpu;
+
+    if (follow_rx && (cpu = GetIncomingCpu(socket)) >= 0){
+        if (num_cpus == 0)
+            return cpu;
+        FOR(i, num_cpus)
+            if (cpus[i] == cpu)
+                return cpu;
+    }
+    if (num_cpus > 0)
+        return cpus[next_cpu++ % num_cpus];
+    return -1;
+}
+
+// the thread is created on its CPU, not moved there after it ran elsewhere
+void PlaceThread(pthread_attr_t* attr, int socket){
+    cpu_set_t set;
+    int cpu;
+
+    if (num_cpus == 0 && !follow_rx)
+        return;
+    if ( (cpu = PickCpu(socket)) < 0 )
+        set = all_cpus;
+    else {
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+    }
+    if ( (errno = pthread_attr_setaffinity_np(attr, sizeof(set), &set)) )
+        Warnx("cpu %d: %s", cpu, strerror(errno));
+}
+
+// drops listed CPUs we may not run on, pthread_create() would fail on them
+void CpuInit(){
+    int i, n = 0;
+
+    if (sched_getaffinity(0, sizeof(all_cpus), &all_cpus))
+        Error("sched_getaffinity");
+    FOR(i, num_cpus){
+        if (CPU_ISSET(cpus[i], &all_cpus))
+            cpus[n++] = cpus[i];
+        else
+            Warnx("cpu %d is not available", cpus[i]);
+    }
+    if (num_cpus > 0 && n == 0)
+        Errx(MP_PARAM_ERR, "none of the -a cpus are available");
+    num_cpus = n;
+}
+#else
+void ParseCpus(const char* list){
+    Warnx("-a %s: no thread affinity on this system", list);
+}
+void PlaceThread(pthread_attr_t* attr, int socket){}
+void CpuInit(){}
+#endif
+
+void Log(const char*, ...);
+void HttpDate(char*);
+
+#include "config.h"
+#include "cache.h"
+#include "trace.h"
+
+// one connected client, owned by its thread
+typedef struct {
+    int socket;
+    int slot;       // index in clients[]
+    int busy;       // in the middle of a response
+    char* ip;
+    int tls;        // accepted on a TLS listener
+    SSL* ssl;       // NULL for plain http
+    int ktls;       // kernel does the TLS records, sendfile() works
+    struct h2_stream* stream; // HTTP/2 stream this response goes to
+    char* host;     // Host or :authority of the request, NULL if none
+    int head;       // HEAD request, headers only
+    struct limit_entry* limit; // per address limits, NULL if none apply
+    int pace_kernel;        // SO_MAX_PACING_RATE took
+    double pace_tokens;     // userspace pacing otherwise
+    int64_t pace_refilled;
+    request_trace trace;    // phases of the request in progress, -t
+} client;
+
+// name based virtual host, the default one serves -r and unknown names
+typedef struct vhost {
+    char* name;     // lower case, no port
+    int root_fd;
+    int index;      // directories serve their index.html instead of a listing
+    file_cache cache;
+    struct bundle_root* bundle; // root is an archive, NULL for a directory
+    char* path;     // absolute root, for FastCGI scripts
+    struct vhost* next;
+} vhost;
+
+vhost default_host = { .name = "", .root_fd = AT_FDCWD, .cache.lock = PTHREAD_MUTEX_INITIALIZER,
+    .cache.landed = PTHREAD_COND_INITIALIZER };
+vhost* vhosts[VHOST_BUCKETS];
+
+#include "http2.h"
+#include "limit.h"
+#include "pool.h"
+
+// CLIENT I/O
+
+ssize_t ClientRead(client* c, void* buff, size_t len){
+    if (c->stream != NULL)
+        return 0; // request bodies are not read on streams
+    if (c->ssl != NULL)
+        return TlsRead(c->ssl, buff, len);
+    return Recv(c->socket, buff, len, 0);
+}
+
+// waits for the next request so an idle connection holds no buffers,
+// 0 after secs without one
+int ClientWait(client* c, int secs){
+    struct pollfd pfd;
+    int n;
+
+    if (c->ssl != NULL && SSL_has_pending(c->ssl))
+        return 1;
+    pfd.fd = c->socket;
+    pfd.events = POLLIN;
+    while ( (n = poll(&pfd, 1, secs * 1000)) == -1 && errno == EINTR );
+    return n;
+}
+
+// not charged to the address, for HTTP/2 frames whose streams already were
+ssize_t ClientWriteRaw(client* c, const void* buff, size_t len){
+    if (c->stream != NULL)
+        return H2Write(c->stream, buff, len);
+    if (c->ssl != NULL)
+        return TlsWriten(c->ssl, buff, len);
+    return Writen(c->socket, buff, len);
+}
+
+ssize_t ClientWrite(client* c, const void* buff, size_t len){
+    LimitBytes(c, len);
+    return ClientWriteRaw(c, buff, len);
+}
+
+// STREAMING
+//
+// A file of stream_min bytes or more is taken for a one-off download: the
+// kernel is told it is read sequentially, so it reads ahead further, and
+// its pages are dropped from the page cache a chunk behind what was sent,
+// so one big download doesn't push the small files everyone asks for out
+// of memory. A big file many clients fetch at once is read from disk by
+// each of them; stream_min (-f) sets where that is cheaper.
+// Chunks follow the send buffer, which the kernel grows for fast
+// clients. Copies through userspace, for TLS records and HTTP/2 frames,
+// go through a page aligned buffer of up to STREAM_BUFFER.
+
+#define STREAM_CHUNK_MIN 65536
+#define STREAM_CHUNK_MAX (4 << 20)  // largest send buffer tcp_wmem gives by default
+#define STREAM_BUFFER    65536
+#define STREAM_DROP_ALIGN (2 << 20) // page cache folios are at most this, aligned to it
+
+int StreamLarge(size_t count){
+    size_t min = Conf()->stream_min;
+    return min > 0 && count >= min;
+}
+
+// bytes per sendfile() or read of a count byte transfer
+size_t StreamChunk(client* c, size_t count){
+    int sndbuf = 0;
+    socklen_t len = sizeof(sndbuf);
+
+    if (c->stream == NULL)
+        getsockopt(c->socket, SOL_SOCKET, SO_SNDBUF, &sndbuf, &len);
+    return MIN(count, MIN(STREAM_CHUNK_MAX, MAX(STREAM_CHUNK_MIN, (size_t) sndbuf)));
+}
+
+// [start, end) went out, drops the pages of it that left. Pages sendfile()
+// put in the send queue stay there until they are acked, copied ones a
+// little while after the read that touched them; either can't be dropped
+// before. The kernel only drops whole folios, so ranges go by the largest
+// one, and the one before is tried again for what was still held then.
+void StreamDrop(client* c, int fd, off_t start, off_t end, size_t chunk, int copied, off_t* dropped){
+    off_t align = STREAM_DROP_ALIGN;
+    off_t from = MAX((start + align - 1) & ~(align - 1), *dropped - align);
+    off_t upto;
+    int queued = chunk;
+
+#ifdef SIOCOUTQ
+    if (!copied && ioctl(c->socket, SIOCOUTQ, &queued) == -1)
+        queued = end - start;
+#endif
+    upto = (end - queued) & ~(align - 1);
+    if (upto > from){
+        posix_fadvise(fd, from, upto - from, POSIX_FADV_DONTNEED);
+        *dropped = upto;
+    }
+}
+
+ssize_t ClientSendFile(client* c, int fd, off_t offset, size_t count){
+    int user = c->stream != NULL || (c->ssl != NULL && !c->ktls); // TLS records or HTTP/2 frames built here
+    int paced = Paced(c, count);
+    int large = StreamLarge(count);
+    size_t chunk = count, left = count;
+    off_t start = offset, dropped = 0;
+    byte* buffer = NULL;
+    ssize_t n;
+
+    if (large){
+        posix_fadvise(fd, offset, count, POSIX_FADV_SEQUENTIAL);
+        chunk = StreamChunk(c, count);
+    }
+    // rate limited or paced: the kernel gets it a chunk at a time
+    if (paced && !user)
+        chunk = MIN(chunk, LIMIT_CHUNK);
+
+    if (user && count <= BUFFER_LEN){
+        buffer = PoolGet(&buffer_pool);
+        chunk = BUFFER_LEN;
+    } else if (user){
+        chunk = MIN(STREAM_BUFFER, (count + getpagesize() - 1) & ~(size_t) (getpagesize() - 1));
+        if (posix_memalign((void**) &buffer, getpagesize(), chunk))
+            Errx(MP_RUNT_ERR, "out of memory");
+    }
+
+    while (left > 0){
+        if (user){
+            if ( (n = pread(fd, buffer, MIN(left, chunk), offset)) <= 0 )
+                break;
+            PaceSend(c, n, count);
+            if (ClientWrite(c, buffer, n) < 0)
+                break;
+        } else {
+            if (paced){
+                LimitBytes(c, MIN(left, chunk));
+                PaceSend(c, MIN(left, chunk), count);
+            }
+            n = c->ssl == NULL ? SendFile(c->socket, fd, offset, MIN(left, chunk)) :
+                TlsSendFile(c->ssl, fd, offset, MIN(left, chunk));
+            if (n <= 0)
+                break;
+        }
+        offset += n;
+        left -= n;
+        if (large)
+            StreamDrop(c, fd, start, offset, chunk, user, &dropped);
+    }
+
+    if (user && count <= BUFFER_LEN)
+        PoolPut(&buffer_pool, buffer);
+    else
+        free(buffer);
+    return count - left;
+}
+
+// request body into fd, spliced on plain sockets; -1 if fd can't be written
+ssize_t ClientRecvFile(client* c, int fd, off_t count){
+    byte* buffer;
+    off_t left = count;
+    ssize_t n;
+
+    if (c->stream != NULL)
+        return 0;
+    if (c->ssl == NULL)
+        return ReadToFile(c->socket, fd, count);
+
+    buffer = PoolGet(&buffer_pool);
+    while (left > 0){
+        if ( (n = TlsRead(c->ssl, buffer, MIN(left, BUFFER_LEN))) <= 0 )
+            break;
+        if (Writen(fd, buffer, n) < 0){
+            PoolPut(&buffer_pool, buffer);
+            return -1;
+        }
+        left -= n;
+    }
+    PoolPut(&buffer_pool, buffer);
+    return count - left;
 }
 
 char* Status(int);
-void WriteHeader(int, int, int, int, const char*);
-void HttpError(int, int);
+void WriteHeader(client*, int, int, int, const char*);
+void WriteResponse(client*, int, int, int, const char*, const void*);
+void HttpError(client*, int);
+void HttpErrorConn(client*, int, int);
+void Redirect(client*, const char*, const char*);
+char* HeaderValue(const char*, const char*);
+extern volatile sig_atomic_t draining;
+
+// CHUNKED
+
+#define CHUNK_HEAD 10  // hex size and CRLF go in front of the data
+
+// Body of unknown length: HTTP/1.1 chunks, HTTP/2 DATA frames. Small
+// writes collect into BUFFER_LEN chunks, each one leaves in a single write.
+typedef struct {
+    client* c;
+    char* buff;     // from buffer_pool: CHUNK_HEAD + BUFFER_LEN + CRLF 0 CRLF CRLF
+    int len;
+    int failed;
+    flight* capture;    // gets a copy of the body, NULL if none
+} body_writer;
+
+// for a header that is already out
+void BodyInit(body_writer* w, client* c){
+    w->c = c;
+    w->buff = PoolGet(&buffer_pool);
+    w->len = 0;
+    w->failed = 0;
+    w->capture = NULL;
+}
+
+// the body is also collected in f, for the requests waiting on it
+void BodyCapture(body_writer* w, flight* f){
+    w->capture = f;
+}
+
+void BodyStart(body_writer* w, client* c, int code, const char* type){
+    BodyInit(w, c);
+    WriteHeader(c, code, 0, -1, type);
+}
+
+void BodyFlush(body_writer* w, int last){
+    char* data = w->buff + CHUNK_HEAD;
+    char size[CHUNK_HEAD + 1];
+    int n, end = w->len;
+
+    if (w->capture != NULL)
+        FlightAppend(w->capture, data, w->len);
+    if (w->c->head || w->failed || (w->len == 0 && !last)){
+        w->len = 0;
+        return;
+    }
+
+    if (w->c->stream != NULL){
+        if (w->len > 0 && ClientWrite(w->c, data, w->len) < 0)
+            w->failed = 1;
+        w->len = 0;
+        return;
+    }
+
+    n = 0;
+    if (w->len > 0){
+        n = sprintf(size, "%x\r\n", w->len);
+        memcpy(data - n, size, n);
+        memcpy(data + end, "\r\n", 2);
+        end += 2;
+    }
+    if (last){
+        memcpy(data + end, "0\r\n\r\n", 5);
+        end += 5;
+    }
+    if (ClientWrite(w->c, data - n, n + end) < 0)
+        w->failed = 1;
+    w->len = 0;
+}
+
+void BodyWrite(body_writer* w, const void* buff, size_t len){
+    const char* ptr = buff;
+    size_t n;
+
+    while (len > 0){
+        if (w->len == BUFFER_LEN)
+            BodyFlush(w, 0);
+        n = MIN(len, BUFFER_LEN - w->len);
+        memcpy(w->buff + CHUNK_HEAD + w->len, ptr, n);
+        w->len += n;
+        ptr += n;
+        len -= n;
+    }
+}
+
+void BodyPrintf(body_writer* w, const char* fmt, ...){
+    va_list args;
+    char* big;
+    int n;
+
+    va_start(args, fmt);
+    n = vsnprintf(w->buff + CHUNK_HEAD + w->len, BUFFER_LEN - w->len, fmt, args);
+    va_end(args);
+    if (n < BUFFER_LEN - w->len){
+        w->len += n;
+        return;
+    }
+
+    // didn't fit in what is left of the chunk, format it aside
+    va_start(args, fmt);
+    big = MLC(char, n + 1);
+    vsnprintf(big, n + 1, fmt, args);
+    va_end(args);
+    BodyWrite(w, big, n);
+    free(big);
+}
+
+// last chunk, returns -1 if the client went away on the way
+int BodyEnd(body_writer* w){
+    int failed;
+    BodyFlush(w, 1);
+    failed = w->failed;
+    PoolPut(&buffer_pool, w->buff);
+    return failed ? -1 : 0;
+}
 
 void CheckRootDir(const char* dir){
 	if (!strncmp(dir, "/", 2)    || !strncmp(dir, "/etc", 5) ||
@@ -63,6 +603,7 @@ struct {
 char* GetType(const char* path){
 	int i, len = strlen(path);
     const char* ext;
+    config* cf = Conf();
 
     if (!strcmp(path, "Makefile") || !strcmp(path, "makefile"))
         return "text/plain";
@@ -74,6 +615,10 @@ char* GetType(const char* path){
 
     ext  = path + i + 1;
 
+    for ( i = cf->num_types - 1; i >= 0; i-- ){ // later lines win
+        if ( !strcmp(ext, cf->types[i].ext) )
+            return cf->types[i].type;
+    }
     for ( i = 0; extensions[i].ext; i++ ){
         if ( !strcmp(ext, extensions[i].ext) )
             return extensions[i].type;
@@ -82,71 +627,89 @@ char* GetType(const char* path){
     return NULL;
 }
 
-void GetFile(int socket, const char* filename){
-    // filename  ./dir/file.txt
-    struct stat st;
+// fd is the open file (consumed), filename its path below the root of v
+void GetFile(client* c, vhost* v, int fd, const struct stat* st, const char* filename){
+    cache_entry* e;
     char* type = GetType(filename);
     if (type == NULL)
         type = DEFAULT_TYPE;
 
-    stat(filename, &st);
-    WriteHeader(socket, 200, 0, st.st_size, type);
-    TransferFile(socket, filename, 0);
+    if (c->head){
+        WriteHeader(c, 200, 0, st->st_size, type);
+        close(fd);
+        return;
+    }
+
+    // small and medium files straight from the shared mapping, by the
+    // kernel only (see cache.h)
+    if (c->stream == NULL && c->ssl == NULL && (e = CacheGet(&v->cache, filename, fd, st)) != NULL ){
+        close(fd);
+        WriteResponse(c, 200, 0, e->size, type, e->data);
+        CacheRelease(e);
+        return;
+    }
+
+    WriteHeader(c, 200, 0, st->st_size, type);
+    ClientSendFile(c, fd, 0, st->st_size);
+    close(fd);
 }
 
 // DIRECTORY
 
-char* FileLink(const char* path, const char* file, off_t size){
-    char* buff = MLC(char, strlen(path) + strlen(file) + 30);
-    long lsize = (long) size;
-    sprintf(buff, "<a href=\"%s\">%s (%ld)</a><br>", path, file, lsize);
-    return buff;
+void FileLink(body_writer* w, const char* path, const char* file, off_t size){
+    BodyPrintf(w, "<a href=\"%s\">%s (%ld)</a><br>", path, file, (long) size);
 }
 
-char* DirLink(const char* dir, const char* preview){
-    char* buff = MLC(char, strlen(dir) + strlen(preview) + 30);
-    sprintf(buff, "<a href=\"%s\">%s [dir]</a><br>", dir, preview);
-    return buff;
+// with the slash, a link without it would cost a redirect
+void DirLink(body_writer* w, const char* dir, const char* preview){
+    BodyPrintf(w, "<a href=\"%s%s\">%s [dir]</a><br>", dir, dir[strlen(dir) - 1] == '/' ? "" : "/", preview);
 }
 
-void GetDir(int socket, const char* dirname){
-
-    // open tmp file
-    int tmp_file;
-    char* tmp_filename = MLC(char, 20);
-	strcpy(tmp_filename, "/tmp/httpXXXXXX");
-	if ( (tmp_file = mkstemp(tmp_filename)) == -1 ){
-        HttpError(socket, 500);
-        free(tmp_filename);
-        return;
-    }
+// fd is the open directory (consumed), dirname the request path /dir.
+// The listing is streamed chunked while the directory is read, and kept
+// for requests for the same listing that come meanwhile; they wait for the
+// leader's last chunk and get it whole. A leader with a slow client holds
+// them up by what doesn't fit in its socket buffer, one directory's worth
+// of links rarely is more.
+void GetDir(client* c, vhost* v, int fd, const char* dirname){
 
     DIR *dir;
     struct dirent *ent;
     struct stat st;
-    char* ptr;
+    body_writer w;
+    flight* f;
 
-    char* path = MLC(char, BUFFER_LEN_SMALL);
+    int i, leader, len = strlen(dirname);
+    char* path;
     char* nameptr;
-    int i, len = strlen(dirname);
     char tmp_char;
 
-    ptr = "<html><title>MrePro web server</title><body><h3>Listing for ";
-    Writen(tmp_file, ptr, strlen(ptr));
-    Writen(tmp_file, dirname+1, len-1);
-    ptr = "</h3><p>";
-    Writen(tmp_file, ptr, strlen(ptr));
+    f = FlightJoin(&v->cache, FLIGHT_LISTING, dirname, &leader);
+    if (!leader || (dir = fdopendir(fd)) == NULL){
+        close(fd);
+        if (leader)
+            FlightLand(&v->cache, f);
+        if (f->ok)
+            WriteResponse(c, 200, 0, f->len, "text/html", f->data);
+        else
+            HttpError(c, 500);
+        FlightLeave(&v->cache, f);
+        return;
+    }
 
+    path = MLC(char, len + NAME_MAX + 2);
     strcpy(path, dirname);
     if (dirname[len-1] != '/')
         path[len++] = '/';
     nameptr = path + len;
 
-    // dirname  ./dir
-    // path     ./dir/
-    // nameptr -------A (pointer for file name insertion)
+    // dirname  /dir
+    // path     /dir/
+    // nameptr  -----A (pointer for file name insertion)
 
-    dir = opendir(dirname);
+    BodyStart(&w, c, 200, "text/html");
+    BodyCapture(&w, f);
+    BodyPrintf(&w, "<html><title>MrePro web server</title><body><h3>Listing for %s</h3><p>", dirname);
 
     while ( (ent=readdir(dir)) != NULL ) {
         // skip .
@@ -155,92 +718,610 @@ void GetDir(int socket, const char* dirname){
 
         if (!strcmp("..", ent->d_name)){
             // only ignore .. in root
-            if (!strcmp("./", dirname))
+            if (len == 1)
                 continue;
 
-            // find first right '/'
-            for(i=strlen(dirname)-1; dirname[i]!='/'; --i);
-            if (i==1)
-                ptr = DirLink("/", "..");
-            else {
-                tmp_char = path[i];
-                path[i] = 0;
-                ptr = DirLink(path+1, "..");
-                path[i] = tmp_char;
-            }
+            // parent is up to the '/' before the last name
+            for(i=len-2; path[i]!='/'; --i);
+            tmp_char = path[i+1];
+            path[i+1] = 0;
+            DirLink(&w, path, "..");
+            path[i+1] = tmp_char;
 
         } else {
             strcpy(nameptr, ent->d_name);
-            if (stat(path, &st)) continue;
+            if (fstatat(dirfd(dir), ent->d_name, &st, 0)) continue;
 
             if (S_ISDIR(st.st_mode))
-                ptr = DirLink(path+1, ent->d_name);
+                DirLink(&w, path, ent->d_name);
             else
-                ptr = FileLink(path+1, ent->d_name, st.st_size);
+                FileLink(&w, path, ent->d_name, st.st_size);
         }
-
-        // write ptr to file
-        Writen(tmp_file, ptr, strlen(ptr));
-        free(ptr);
     }
     closedir (dir);
 
-    ptr = "</p></body></html>";
-    Writen(tmp_file, ptr, strlen(ptr));
-    close(tmp_file);
-
-    stat(tmp_filename, &st);
-
-    WriteHeader(socket, 200, 0, st.st_size, "text/html");
-    TransferFile(socket, tmp_filename, 0);
-
-    unlink(tmp_filename);
+    BodyPrintf(&w, "</p></body></html>");
+    BodyEnd(&w);
     free(path);
-    free(tmp_filename);
+
+    f->ok = 1;
+    FlightLand(&v->cache, f);
+    FlightLeave(&v->cache, f);
 }
 
 // GET
 
+// index.html at the end of the path lists its directory instead
 void RemoveIndex(char* path){
     int len = strlen(path);
     const char* IDX = "index.html";
     const int idx_len = strlen(IDX);
 
-    if (!strncmp( path+len-idx_len+1, IDX, idx_len ))
-        path[len-idx_len+1] = 0;
+    if (len > idx_len && path[len-idx_len-1] == '/' && !strcmp(path+len-idx_len, IDX))
+        path[len-idx_len] = 0;
+}
+
+int HexDigit(char ch){
+    if (ch >= '0' && ch <= '9') return ch - '0';
+    if (ch >= 'a' && ch <= 'f') return ch - 'a' + 10;
+    if (ch >= 'A' && ch <= 'F') return ch - 'A' + 10;
+    return -1;
 }
 
-void Get(int socket, char* path){
-    int i, len = strlen(path);
-    char* dot = MLC(char, len+2);
+// in place, drops the query string, -1 on a bad escape or an encoded NUL
+int PercentDecode(char* path){
+    char* in = path;
+    char* out = path;
+    int hi, lo;
 
-    RemoveIndex(path);
+    for (; *in && *in != '?' && *in != '#'; in++){
+        if (*in != '%'){
+            *out++ = *in;
+            continue;
+        }
+        if ( (hi = HexDigit(in[1])) < 0 || (lo = HexDigit(in[2])) < 0 || (hi | lo) == 0 )
+            return -1;
+        *out++ = hi << 4 | lo;
+        in += 2;
+    }
+    *out = 0;
+    return 0;
+}
 
-    if (path[0] != '/')
-        sprintf(dot, "./%s", path);
+// open path below dirfd, never resolving outside of it; EXDEV if it tries
+int OpenBeneath(int dirfd, const char* path, int flags){
+    const char* p;
+#ifdef SYS_openat2
+    struct open_how how;
+    int fd;
+#endif
+
+    // openat() ignores dirfd for absolute paths: //etc/passwd
+    if (path[0] == '/'){
+        errno = EXDEV;
+        return -1;
+    }
+#ifdef SYS_openat2
+    memset(&how, 0, sizeof(how));
+    how.flags = flags | O_CLOEXEC;
+    how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+    if ( (fd = syscall(SYS_openat2, dirfd, path, &how, sizeof(how))) != -1 || errno != ENOSYS )
+        return fd;
+#endif
+    // no openat2(), refuse .. components and follow symlinks as before
+    for (p = path; *p; p++){
+        if (p[0] == '.' && p[1] == '.' && (p == path || p[-1] == '/') && (p[2] == '/' || p[2] == 0)){
+            errno = EXDEV;
+            return -1;
+        }
+    }
+    return openat(dirfd, path, flags | O_CLOEXEC);
+}
+
+#include "bundle.h"
+
+// VIRTUAL HOSTS
+
+unsigned int VhostHash(const char* name){
+    unsigned int h = 2166136261u; // FNV-1a
+    while (*name){
+        h ^= (byte) *name++;
+        h *= 16777619u;
+    }
+    return h % VHOST_BUCKETS;
+}
+
+// Host header to table key: lower case, no port, no trailing dot
+void HostKey(const char* host, char* key, size_t max){
+    size_t i;
+    const char* end = strchr(host, ']');   // [v6]:port
+
+    if (end == NULL)
+        end = strchr(host, ':');
     else
-        sprintf(dot, ".%s", path);
+        end++;
+    if (end == NULL)
+        end = host + strlen(host);
+
+    for (i = 0; host + i < end && i < max - 1; i++)
+        key[i] = tolower((byte) host[i]);
+    if (i > 0 && key[i-1] == '.')
+        i--;
+    key[i] = 0;
+}
+
+// -v name=dir[,index], dir relative to where we were started; a file is
+// served as a bundle
+void VhostAdd(const char* spec){
+    const char* eq = strchr(spec, '=');
+    char* dir;
+    char* opt;
+    vhost* v;
+    struct stat st;
+    unsigned int h;
 
-    for(i=0; i<len-1; i++){
-        if (path[i]=='.' && path[i+1]=='.'){
-            HttpError(socket, 400);
-            free(dot);
+    if (eq == NULL || eq == spec || eq[1] == 0)
+        Errx(MP_PARAM_ERR, "bad virtual host %s, want name=dir[,index]", spec);
+
+    v = Calloc(sizeof(vhost));
+    dir = strndup(spec, eq - spec);
+    v->name = MLC(char, (eq - spec + 1));
+    HostKey(dir, v->name, eq - spec + 1);
+    free(dir);
+
+    dir = strdup(eq + 1);
+    if ( (opt = strchr(dir, ',')) != NULL ){
+        *opt++ = 0;
+        if (strcmp(opt, "index"))
+            Errx(MP_PARAM_ERR, "unknown virtual host option %s", opt);
+        v->index = 1;
+    }
+    CheckRootDir(dir);
+    v->path = realpath(dir, NULL);
+    if ( (v->root_fd = open(dir, O_RDONLY | O_CLOEXEC)) == -1 )
+        Error(dir);
+    if (fstat(v->root_fd, &st) == 0 && S_ISREG(st.st_mode)){
+        close(v->root_fd);
+        v->root_fd = -1;
+        v->bundle = BundleRoot(dir);
+    }
+    free(dir);
+    CacheInit(&v->cache);
+
+    h = VhostHash(v->name);
+    v->next = vhosts[h];
+    vhosts[h] = v;
+}
+
+// virtual host for a request, the default one if nothing matches
+vhost* VhostFind(const char* host){
+    char key[PATH_LEN];
+    vhost* v;
+
+    if (host == NULL)
+        return &default_host;
+
+    HostKey(host, key, sizeof(key));
+    for (v = vhosts[VhostHash(key)]; v != NULL; v = v->next){
+        if (!strcmp(v->name, key))
+            return v;
+    }
+    return &default_host;
+}
+
+// response code for a failed OpenBeneath()
+int OpenStatus(int error){
+    switch (error) {
+        case EXDEV:
+            return 400;
+        case EACCES:
+        case ELOOP:
+            return 403;
+        default:
+            return 404;
+    }
+}
+
+void Get(client* c, char* path){
+    vhost* v = VhostFind(c->host);
+    struct stat st;
+    const char* rel;
+    const char* query;
+    char* idx;
+    int fd, ifd;
+
+    // decoding only writes before the '?', the query stays for a redirect
+    query = strchr(path, '?');
+    if (query != NULL)
+        query++;
+    if (path[0] != '/' || PercentDecode(path)){
+        HttpError(c, 400);
+        return;
+    }
+    if (v->bundle != NULL){
+        GetBundle(c, v->bundle, path, query);
+        return;
+    }
+    if (!v->index)
+        RemoveIndex(path);
+
+    // one lookup gives the fd, fstat() the rest
+    rel = path[1] ? path + 1 : ".";
+    if ( (fd = OpenBeneath(v->root_fd, rel, O_RDONLY | O_NONBLOCK)) == -1 ){
+        HttpError(c, OpenStatus(errno));
+        return;
+    }
+    PROBE2(open, c->socket, rel);
+    TraceMark(&c->trace, TRACE_OPEN);
+    fstat(fd, &st);
+
+    // relative links in the listing or index.html need the slash
+    if (S_ISDIR(st.st_mode) && path[strlen(path) - 1] != '/'){
+        close(fd);
+        Redirect(c, path, query);
+        return;
+    }
+
+    // index policy: a directory with index.html serves that instead
+    if (S_ISDIR(st.st_mode) && v->index){
+        if ( (ifd = OpenBeneath(fd, "index.html", O_RDONLY | O_NONBLOCK)) != -1 ){
+            close(fd);
+            fd = ifd;
+            fstat(fd, &st);
+            idx = MLC(char, strlen(path) + 12);
+            sprintf(idx, "%s%sindex.html", path + 1, path[strlen(path) - 1] == '/' ? "" : "/");
+            if (S_ISREG(st.st_mode)){
+                fcntl(fd, F_SETFL, 0);
+                GetFile(c, v, fd, &st, idx);
+            } else {
+                close(fd);
+                HttpError(c, 403);
+            }
+            free(idx);
             return;
         }
     }
 
+    if (S_ISDIR(st.st_mode))
+        GetDir(c, v, fd, path);
+    else if (S_ISREG(st.st_mode)){
+        fcntl(fd, F_SETFL, 0); // O_NONBLOCK was only for FIFOs and devices
+        GetFile(c, v, fd, &st, rel);
+    } else {
+        close(fd);
+        HttpError(c, 403);
+    }
+}
+
+// WARMING
+//
+// -w manifest lists what to have hot before the first client comes: one
+// path per line, "host /path" for a virtual host, # comments. Our own log
+// works as a manifest too, its "ip -> GET /path" lines are picked up, so
+// yesterday's log is a recorded hot set. Files are opened and stat()ed by
+// warm_threads threads; ones the mmap cache takes are mapped into it, the
+// others get their pages read ahead. Bundle members are read ahead in the
+// mapping.
+
+
+typedef struct {
+    char** lines;
+    int num_lines;
+    int next;       // taken with __sync_fetch_and_add()
+    int files;
+    long long bytes;
+} warm_job;
+
+// one manifest line, the bytes it warmed or -1 if it named no file
+long long WarmPath(char* line){
+    char* host = NULL;
+    char* path = line;
+    char* ptr;
+    vhost* v;
+    bundle* b;
+    bundle_entry* e;
+    cache_entry* ce;
     struct stat st;
-    if (access(dot, F_OK)){
-        HttpError(socket, 404);
-        free(dot);
+    long long bytes = -1;
+    int fd;
+
+    if ( (ptr = strstr(line, " -> GET ")) != NULL )
+        path = ptr + 8;             // log line
+    else if (line[0] != '/' && (ptr = strchr(line, ' ')) != NULL){
+        *ptr = 0;                   // host /path
+        host = line;
+        path = ptr + 1;
+    }
+    path[strcspn(path, " \t")] = 0;
+    if (path[0] != '/' || PercentDecode(path))
+        return -1;
+
+    v = VhostFind(host);
+    if (v->bundle != NULL){
+        b = BundleAcquire(v->bundle);
+        if ( (e = BundleFind(b, path + 1, strlen(path + 1))) != NULL ){
+            madvise(b->map + (e->offset & ~(off_t) (getpagesize() - 1)),
+                e->size + (e->offset & (getpagesize() - 1)), MADV_WILLNEED);
+            bytes = e->size;
+        }
+        BundleRelease(v->bundle, b);
+        return bytes;
+    }
+
+    if ( (fd = OpenBeneath(v->root_fd, path[1] ? path + 1 : ".", O_RDONLY | O_NONBLOCK)) == -1 )
+        return -1;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)){
+        if ( (ce = CacheGet(&v->cache, path + 1, fd, &st)) != NULL )
+            CacheRelease(ce);
+        else
+            posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+        bytes = st.st_size;
+    }
+    close(fd);
+    return bytes;
+}
+
+void* WarmThread(void* args){
+    warm_job* job = args;
+    long long bytes;
+    int i;
+
+    while ( (i = __sync_fetch_and_add(&job->next, 1)) < job->num_lines ){
+        if ( (bytes = WarmPath(job->lines[i])) < 0 )
+            continue;
+        __sync_fetch_and_add(&job->files, 1);
+        __sync_fetch_and_add(&job->bytes, bytes);
+    }
+    return NULL;
+}
+
+// before accepting, after the roots and caches are set up
+void Warm(const char* manifest){
+    FILE* file;
+    char line[PATH_LEN * 4];
+    warm_job job = { NULL, 0, 0, 0, 0 };
+    pthread_t* tids;
+    struct timespec start, end;
+    int i, cap = 0, n = 0;
+
+    if ( (file = fopen(manifest, "r")) == NULL ){
+        Warnx("%s: %s", manifest, strerror(errno));
         return;
     }
-    stat(dot,&st);
+    while (fgets(line, sizeof(line), file) != NULL){
+        line[strcspn(line, "\r\n")] = 0;
+        if (line[0] == 0 || line[0] == '#')
+            continue;
+        if (job.num_lines == cap){
+            cap = MAX(cap * 2, 256);
+            job.lines = Realloc(job.lines, cap * sizeof(char*));
+        }
+        job.lines[job.num_lines++] = strdup(line);
+    }
+    fclose(file);
 
-    if (S_ISDIR(st.st_mode))
-        GetDir(socket, dot);
-    else
-        GetFile(socket, dot);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    tids = MLC(pthread_t, conf->warm_threads);
+    FOR(i, MIN(conf->warm_threads, job.num_lines))
+        if (pthread_create(tids + n, NULL, WarmThread, &job) == 0)
+            n++;
+    WarmThread(&job);
+    ConfPut(); // main is not a reader, it swaps
+    FOR(i, n)
+        pthread_join(tids[i], NULL);
+    free(tids);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    Log("Warmed %d of %d paths, %lld bytes in %ld ms\n", job.files, job.num_lines, job.bytes,
+        (long) ((end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000));
+    FOR(i, job.num_lines)
+        free(job.lines[i]);
+    free(job.lines);
+}
+
+// PUT
+
+int upload_seq = 0;
+
+// request body: what came with the headers first, then the socket
+typedef struct {
+    client* c;
+    int from;       // socket read instead of the client, -1 if none
+    char* buff;
+    int pos, len;
+} body_reader;
+
+int BodyFill(body_reader* r){
+    if (r->from >= 0)
+        return Recv(r->from, r->buff, BUFFER_LEN, 0);
+    return ClientRead(r->c, r->buff, BUFFER_LEN);
+}
+
+int BodyByte(body_reader* r){
+    if (r->pos == r->len){
+        if ( (r->len = BodyFill(r)) <= 0 )
+            return -1;
+        r->pos = 0;
+    }
+    return (byte) r->buff[r->pos++];
+}
 
-    free(dot);
+// one CRLF terminated line without the CRLF, -1 if too long or cut off
+int BodyLine(body_reader* r, char* line, int max){
+    int ch, len = 0;
+    while ( (ch = BodyByte(r)) != -1 && ch != '\n' ){
+        if (len == max - 1)
+            return -1;
+        line[len++] = ch;
+    }
+    if (ch == -1)
+        return -1;
+    if (len > 0 && line[len-1] == '\r')
+        len--;
+    line[len] = 0;
+    return len;
 }
+
+// Content-Length value, -1 unless it is digits only and fits: read
+// loosely "12abc" would be 12 and leave the rest as the next request
+long long ContentLength(const char* value){
+    long long n = 0;
+
+    if (!isdigit((byte) *value))
+        return -1;
+    for ( ; isdigit((byte) *value); value++ ){
+        if (n > (LLONG_MAX - (*value - '0')) / 10)
+            return -1;
+        n = n * 10 + *value - '0';
+    }
+    value += strspn(value, " \t"); // whitespace at the end of the field
+    return *value == 0 ? n : -1;
+}
+
+// count body bytes into fd, 0 when they all made it
+int BodyCopy(body_reader* r, int fd, off_t count){
+    int n = MIN(count, r->len - r->pos);
+
+    if (n > 0){
+        if (Writen(fd, r->buff + r->pos, n) < 0)
+            return -1;
+        r->pos += n;
+        count -= n;
+    }
+    return count == 0 || ClientRecvFile(r->c, fd, count) == count ? 0 : -1;
+}
+
+// chunked body into fd, chunked again if framed; 0 when it all made it,
+// otherwise the response code
+int BodyChunked(body_reader* r, int fd, off_t max, int framed){
+    char line[BUFFER_LEN_SMALL];
+    off_t total = 0;
+    long long size;
+    char* end;
+
+    for (;;){
+        if (BodyLine(r, line, sizeof(line)) < 0)
+            return 400;
+        size = strtoll(line, &end, 16);
+        if (end == line || size < 0 || (*end != 0 && *end != ';' && !isspace((byte) *end)))
+            return 400;
+        if (size == 0)
+            break;
+        if ( (total += size) > max )
+            return 413;
+        if (framed && dprintf(fd, "%llx\r\n", size) < 0)
+            return 400;
+        if (BodyCopy(r, fd, size) || BodyLine(r, line, sizeof(line)) != 0)
+            return 400;
+        if (framed && Writen(fd, "\r\n", 2) < 0)
+            return 400;
+    }
+    // trailers
+    while ( (size = BodyLine(r, line, sizeof(line))) > 0 );
+    if (size < 0 || (framed && Writen(fd, "0\r\n\r\n", 5) < 0))
+        return 400;
+    return 0;
+}
+
+// PUT and POST store the body at path, written aside and renamed in place.
+// Returns 0 when the connection can't carry on.
+int Put(client* c, const char* method, const char* request, int req_len, char* path){
+    vhost* v = VhostFind(c->host);
+    const char* body = strstr(request, "\r\n\r\n");
+    char* length = HeaderValue(request, "Content-Length");
+    char* encoding = HeaderValue(request, "Transfer-Encoding");
+    char* expect = HeaderValue(request, "Expect");
+    const char* cont = "HTTP/1.1 100 Continue\r\n\r\n";
+    char* name;
+    char tmp[64];
+    body_reader r;
+    struct stat st;
+    long long size = -1;
+    int chunked = encoding != NULL && strlen(encoding) >= 7 &&
+        !strcasecmp(encoding + strlen(encoding) - 7, "chunked");
+    int dfd = -1, fd = -1, existed, code = 0;
+    off_t max_upload = Conf()->max_upload;
+
+    Log("%s -> %s %s\n", c->ip, method, path);
+
+    if (!LimitRequest(c))
+        code = 429;
+    else if (max_upload == 0)
+        code = 405;
+    else if (body == NULL || path[0] != '/' || PercentDecode(path) ||
+             (name = strrchr(path, '/')) == NULL || name[1] == 0 ||
+             !strcmp(name, "/.") || !strcmp(name, "/.."))
+        code = 400;
+    else if (encoding != NULL && !chunked)
+        code = 501;
+    else if (!chunked && length == NULL)
+        code = 411;
+    else if (!chunked && (size = ContentLength(length)) < 0)
+        code = 400;
+    else if (!chunked && size > max_upload)
+        code = 413;
+
+    if (code == 0){
+        // directory the file goes to, below the root like everything else
+        *name = 0;
+        dfd = OpenBeneath(v->root_fd, path[0] ? path + 1 : ".", O_RDONLY | O_DIRECTORY);
+        *name++ = '/';
+        if (dfd == -1)
+            code = OpenStatus(errno);
+    }
+    if (code == 0){
+        existed = !fstatat(dfd, name, &st, AT_SYMLINK_NOFOLLOW);
+        if (existed && !S_ISREG(st.st_mode))
+            code = 409;
+    }
+    if (code == 0){
+        sprintf(tmp, ".upload-%d-%d", (int) getpid(), __sync_fetch_and_add(&upload_seq, 1));
+        if ( (fd = openat(dfd, tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644)) == -1 )
+            code = errno == EACCES ? 403 : 500;
+    }
+
+    if (code == 0){
+        if (expect != NULL && !strcasecmp(expect, "100-continue"))
+            ClientWrite(c, cont, strlen(cont));
+
+        r.c = c;
+        r.from = -1;
+        r.buff = PoolGet(&buffer_pool);
+        r.len = request + req_len - (body + 4);
+        r.pos = 0;
+        memcpy(r.buff, body + 4, r.len);
+
+        if (chunked)
+            code = BodyChunked(&r, fd, max_upload, 0);
+        else
+            code = BodyCopy(&r, fd, size) ? 400 : 0;
+        if (code == 0)
+            code = 201;
+        PoolPut(&buffer_pool, r.buff);
+        close(fd);
+
+        if (code == 201 && renameat(dfd, tmp, dfd, name))
+            code = 500;
+        if (code != 201)
+            unlinkat(dfd, tmp, 0);
+        else if (existed)
+            code = 200;
+    }
+
+    if (dfd != -1)
+        close(dfd);
+    free(length);
+    free(encoding);
+    free(expect);
+
+    if (code == 200 || code == 201){
+        WriteHeader(c, code, 0, 0, NULL);
+        return 1;
+    }
+    // the body, or what is left of it, is still on the wire
+    HttpErrorConn(c, code, 1);
+    return 0;
+}
+
+#include "proxy.h"
+#include "fcgi.h"
@@ -1,5 +1,10 @@
+#ifdef __linux__
+#define _GNU_SOURCE // splice()
+#endif
 #include "mrepro.h"
 
+int is_daemon;
+
 void Getaddrinfo(const char* hostname, const char* servicename,
                     const struct addrinfo* hints, struct addrinfo** result)
 {
@@ -34,9 +39,53 @@ u_short In_port(const struct sockaddr *sa){
     u_short family = sa->sa_family;
     if (family == AF_INET)
 	return          ( (struct sockaddr_in*)  sa)->sin_port;
+    if (family == AF_UNIX)
+	return 0;
     return (u_short)( (struct sockaddr_in6*) sa)->sin6_port;
 }
 
+// socket bound to host:port, host NULL is the wildcard address
+int PassiveSocket(const char* host, const char* port, int socktype){
+    struct addrinfo hints, *res, *ai;
+    int sfd, v6only;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_flags    = AI_PASSIVE;
+    hints.ai_socktype = socktype;
+
+    Getaddrinfo(host, port, &hints, &res);
+
+    // wildcard: one dual-stack IPv6 socket takes IPv4 peers as well
+    sfd = -1;
+    if (host == NULL){
+        for (ai = res; ai != NULL && ai->ai_family != AF_INET6; ai = ai->ai_next);
+        if (ai != NULL && (sfd = socket(AF_INET6, socktype, ai->ai_protocol)) != -1){
+            v6only = 0;
+            Setsockopt(sfd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only));
+        }
+    }
+
+    // explicit IPv6 address only takes IPv6, so [::] and 0.0.0.0 can coexist
+    if (sfd == -1){
+        ai = res;
+        sfd = Socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (ai->ai_family == AF_INET6){
+            v6only = 1;
+            Setsockopt(sfd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only));
+        }
+    }
+
+    // has to be set before bind to take effect
+    if (socktype == SOCK_STREAM)
+        SetReuseAddr(sfd);
+
+    Bind(sfd, ai->ai_addr, ai->ai_addrlen);
+    freeaddrinfo(res);
+
+    return sfd;
+}
+
 /*****************************************************************************
  *                                                                           *
  *                                 Wrappers                                  *
@@ -57,6 +106,12 @@ u_short In_port(const struct sockaddr *sa){
  	return ptr;
  }
 
+ void* Realloc(void* ptr, size_t size){
+ 	if ((ptr = realloc(ptr, size)) == NULL)
+ 		Errx(MP_RUNT_ERR, "realloc: %s", strerror(errno));
+ 	return ptr;
+ }
+
  pid_t Fork(){
      pid_t pid;
      if ((pid=fork()) == -1)
@@ -161,6 +216,70 @@ void Close(int socket){
     // if (error < 0) Warnx("close: %s", strerror(errno));
 }
 
+// pass open descriptors to another process over a unix socket
+ssize_t SendFds(int socket, const void* data, size_t len, const int* fds, int nfds){
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr* cmsg;
+    char* control = Calloc(CMSG_SPACE(nfds * sizeof(int)));
+    ssize_t status;
+
+    iov.iov_base = (void*) data;
+    iov.iov_len  = len;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = control;
+    msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type  = SCM_RIGHTS;
+    cmsg->cmsg_len   = CMSG_LEN(nfds * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+
+    status = sendmsg(socket, &msg, 0);
+    if (status < 0) Warnx("sendmsg: %s", strerror(errno));
+    free(control);
+    return status;
+}
+
+// *nfds is capacity of fds on the way in, number received on the way out
+ssize_t RecvFds(int socket, void* data, size_t len, int* fds, int* nfds){
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr* cmsg;
+    char* control = Calloc(CMSG_SPACE(*nfds * sizeof(int)));
+    ssize_t status;
+    int n = 0;
+
+    iov.iov_base = data;
+    iov.iov_len  = len;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = control;
+    msg.msg_controllen = CMSG_SPACE(*nfds * sizeof(int));
+
+    status = recvmsg(socket, &msg, 0);
+    if (status < 0) Warnx("recvmsg: %s", strerror(errno));
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); status >= 0 && cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        n = MIN(n, *nfds);
+        memcpy(fds, CMSG_DATA(cmsg), n * sizeof(int));
+        break;
+    }
+
+    *nfds = n;
+    free(control);
+    return status;
+}
+
 /*****************************************************************************
  *                                                                           *
  *                                 UDP                                       *
@@ -168,22 +287,7 @@ void Close(int socket){
  *****************************************************************************/
 
  int UDPserver(const char* port){
-     struct addrinfo hints, *res;
-     int socket;
-
-     memset(&hints, 0, sizeof(hints));
-     hints.ai_family   = AF_INET;
-     hints.ai_flags    = AI_PASSIVE;
-     hints.ai_socktype = SOCK_DGRAM;
-
-     // create socket
-     Getaddrinfo(NULL, port, &hints, &res);
-     socket = Socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-     Bind(socket, res->ai_addr, res->ai_addrlen);
-
-     freeaddrinfo(res);
-
-     return socket;
+     return PassiveSocket(NULL, port, SOCK_DGRAM);
  }
 
 /*****************************************************************************
@@ -214,18 +318,24 @@ void Connect(int socket, const struct sockaddr* server, socklen_t addrlen){
 
 char* GetIP(const struct sockaddr* addr){
     char* ip = MLC(char, IP_LEN);
-    inet_ntop(addr->sa_family, In_addr(addr), ip, IP_LEN);
+    const struct in6_addr* in6 = &((const struct sockaddr_in6*) addr)->sin6_addr;
+    if (addr->sa_family == AF_UNIX)
+        strcpy(ip, "unix");
+    else if (addr->sa_family == AF_INET6 && IN6_IS_ADDR_V4MAPPED(in6))
+        inet_ntop(AF_INET, in6->s6_addr + 12, ip, IP_LEN); // dual-stack peer
+    else
+        inet_ntop(addr->sa_family, In_addr(addr), ip, IP_LEN);
     return ip;
 }
 
 char* GetClientInfo(int socket, u_short* port){
-    struct sockaddr addr;
+    struct sockaddr_storage addr;
     socklen_t addrlen = sizeof(addr);
-    Getpeername(socket, &addr, &addrlen);
+    Getpeername(socket, (struct sockaddr*) &addr, &addrlen);
     if (port != NULL)
-        *port = ntohs(In_port(&addr));
+        *port = ntohs(In_port((struct sockaddr*) &addr));
 
-    return GetIP(&addr);
+    return GetIP((struct sockaddr*) &addr);
 }
 
 void ReadStringUntil(int socket, char* ptr, int size, char end){
@@ -257,18 +367,78 @@ void WriteString(int socket, const char* fmt, ...){
 }
 
 void ReadFileFrom(int socket, const char* path, const char* fopen_mode){
-    FILE* file;
-    int len;
-    byte* buffer;
+    FILE* file = fopen(path, fopen_mode);
 
-    file = fopen(path, fopen_mode);
-    buffer = MLC(byte, BUFFER_LEN);
-
-    while( ( len = Readn(socket, buffer, BUFFER_LEN) ) > 0 )
-        fwrite(buffer, sizeof(byte), len, file);
+    if (file == NULL){
+        Warnx("fopen %s: %s", path, strerror(errno));
+        return;
+    }
+    fflush(file);
+    ReadToFile(socket, fileno(file), -1);
     fclose(file);
+}
 
+// count bytes from socket into fd, everything up to EOF if count < 0;
+// splice()d through a pipe where the platform has it. Returns the bytes
+// moved, short if the socket ended or failed, -1 if fd can't be written.
+ssize_t ReadToFile(int socket, int fd, off_t count){
+    off_t left = count;
+    ssize_t n, w, total = 0;
+    byte* buffer;
+#ifdef __linux__
+    int pfd[2], spliced;
+
+    // splice() refuses O_APPEND files
+    if (!(fcntl(fd, F_GETFL) & O_APPEND) && pipe(pfd) == 0){
+        spliced = 1;
+        while (left != 0){
+            n = splice(socket, NULL, pfd[1], NULL, left > 0 ? MIN(left, 65536) : 65536,
+                SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0 && errno == EINVAL && total == 0){
+                spliced = 0; // socket can't splice, copy below
+                break;
+            }
+            if (n <= 0)
+                break;
+            for (w = 0; n > 0; n -= w){
+                if ( (w = splice(pfd[0], NULL, fd, NULL, n, SPLICE_F_MOVE)) <= 0 ){
+                    if (w < 0 && errno == EINTR){
+                        w = 0;
+                        continue;
+                    }
+                    close(pfd[0]);
+                    close(pfd[1]);
+                    return -1;
+                }
+                total += w;
+                if (left > 0) left -= w;
+            }
+        }
+        close(pfd[0]);
+        close(pfd[1]);
+        if (spliced)
+            return total;
+    }
+#endif
+    buffer = MLC(byte, BUFFER_LEN);
+    while (left != 0){
+        if ( (n = read(socket, buffer, left > 0 ? MIN(left, BUFFER_LEN) : BUFFER_LEN)) < 0 ){
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (n == 0)
+            break;
+        if (Writen(fd, buffer, n) < 0){
+            total = -1;
+            break;
+        }
+        total += n;
+        if (left > 0) left -= n;
+    }
     free(buffer);
+    return total;
 }
 
 void TransferFile(int socket, const char* path, uint32_t offset){
@@ -285,21 +455,61 @@ void TransferFile(int socket, const char* path, uint32_t offset){
     free(buffer);
 }
 
+// zero-copy where the platform has it, read/write otherwise
+ssize_t SendFile(int socket, int fd, off_t offset, size_t count){
+    size_t left = count;
+    ssize_t n;
+#ifdef __linux__
+    while (left > 0){
+        if ( (n = sendfile(socket, fd, &offset, left)) < 0 ){
+            if (errno == EINTR) continue;
+            Warnx("sendfile: %s", strerror(errno));
+            return -1;
+        }
+        if (n == 0) break; // file shrank
+        left -= n;
+    }
+#else
+    byte* buffer = MLC(byte, BUFFER_LEN);
+    while (left > 0){
+        if ( (n = pread(fd, buffer, MIN(left, BUFFER_LEN), offset)) <= 0 )
+            break;
+        if (Writen(socket, buffer, n) < 0){
+            free(buffer);
+            return -1;
+        }
+        offset += n;
+        left -= n;
+    }
+    free(buffer);
+#endif
+    return count - left;
+}
+
 int TCPserver(const char* port, int backlog){
-	struct addrinfo hints, *res;
-	int socket;
+    return TCPserverOn(NULL, port, backlog);
+}
 
-	memset(&hints, 0, sizeof(hints));
-    hints.ai_family   = AF_INET;
-    hints.ai_flags    = AI_PASSIVE;
-    hints.ai_socktype = SOCK_STREAM;
+int TCPserverOn(const char* host, const char* port, int backlog){
+    int socket = PassiveSocket(host, port, SOCK_STREAM);
+    Listen(socket, backlog);
+    return socket;
+}
 
-    Getaddrinfo(NULL, port, &hints, &res);
-    socket = Socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-    Bind(socket, res->ai_addr, res->ai_addrlen);
+int UnixServer(const char* path, int backlog){
+    struct sockaddr_un addr;
+    int socket;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+        Errx(MP_ADDR_ERR, "unix socket path too long: %s", path);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    socket = Socket(AF_UNIX, SOCK_STREAM, 0);
+    Bind(socket, (struct sockaddr*) &addr, sizeof(addr));
     Listen(socket, backlog);
-    SetReuseAddr(socket);
-    freeaddrinfo(res);
 
     return socket;
 }
@@ -315,12 +525,65 @@ int TCPclient(const char* host, const char* port){
 
     Getaddrinfo(host, port, &hints, &res);
     socket = Socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-    Connect(socket, res->ai_addr, sizeof(struct sockaddr));
+    Connect(socket, res->ai_addr, res->ai_addrlen);
 
     freeaddrinfo(res);
     return socket;
 }
 
+// TCPclient() for peers that may be down: tries every address, -1 if none
+// of them answers
+int TCPconnect(const char* host, const char* port){
+    struct addrinfo hints, *res, *ai;
+    int error, s = -1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if ( (error = getaddrinfo(host, port, &hints, &res)) ){
+        Warnx("getaddrinfo %s: %s", host, gai_strerror(error));
+        errno = EHOSTUNREACH;
+        return -1;
+    }
+    for (ai = res; ai != NULL; ai = ai->ai_next){
+        if ( (s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) == -1 )
+            continue;
+        if (connect(s, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        error = errno;
+        close(s);
+        errno = error;
+        s = -1;
+    }
+    freeaddrinfo(res);
+    return s;
+}
+
+// TCPconnect() for a unix socket path, -1 if nothing listens there
+int UnixConnect(const char* path){
+    struct sockaddr_un addr;
+    int s, error;
+
+    if (strlen(path) >= sizeof(addr.sun_path)){
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    if ( (s = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 )
+        return -1;
+    if (connect(s, (struct sockaddr*) &addr, sizeof(addr)) == -1){
+        error = errno;
+        close(s);
+        errno = error;
+        return -1;
+    }
+    return s;
+}
+
 void TCPserverUsage(const char* name){
     Errx(MP_PARAM_ERR, "Usage: %s [-p port]", name);
 }
@@ -426,6 +689,34 @@ ssize_t Writen(int fd, const void *vptr, size_t n){
     return n;
 }
 
+// writes all of iov, which is consumed in the process
+ssize_t Writevn(int fd, struct iovec* iov, int iovcnt){
+    size_t n = 0;
+    ssize_t nwritten;
+    int i;
+
+    FOR(i, iovcnt)
+        n += iov[i].iov_len;
+
+    while (iovcnt > 0) {
+        if ( (nwritten = writev(fd, iov, iovcnt)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        while (iovcnt > 0 && nwritten >= iov->iov_len) {
+            nwritten -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char*) iov->iov_base + nwritten;
+            iov->iov_len -= nwritten;
+        }
+    }
+    return n;
+}
+
 ssize_t Readn(int fd, void *vptr, size_t n){
     size_t nleft = n;
     ssize_t nread;
@@ -466,6 +757,64 @@ void SetReuseAddr(int sfd){
     Setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
 }
 
+void SetNoDelay(int sfd, int on){
+    Setsockopt(sfd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+void SetBufSize(int sfd, int sndbuf, int rcvbuf){
+    if (sndbuf > 0)
+        Setsockopt(sfd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+    if (rcvbuf > 0)
+        Setsockopt(sfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+}
+
+// wake accept() only once the request data is there
+void SetDeferAccept(int sfd, int seconds){
+#ifdef TCP_DEFER_ACCEPT
+    Setsockopt(sfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &seconds, sizeof(seconds));
+#else
+    Warnx("TCP_DEFER_ACCEPT not supported");
+#endif
+}
+
+void SetFastOpen(int sfd, int qlen){
+#ifdef TCP_FASTOPEN
+    Setsockopt(sfd, IPPROTO_TCP, TCP_FASTOPEN, &qlen, sizeof(qlen));
+#else
+    Warnx("TCP_FASTOPEN not supported");
+#endif
+}
+
+// limit unsent data queued in the kernel, poll() reports writable below it
+void SetNotSentLowat(int sfd, int bytes){
+#ifdef TCP_NOTSENT_LOWAT
+    Setsockopt(sfd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &bytes, sizeof(bytes));
+#else
+    Warnx("TCP_NOTSENT_LOWAT not supported");
+#endif
+}
+
+// kernel paces the socket (fq, or TCP's own pacing), 0 if it can't
+int SetPacingRate(int sfd, unsigned int bytes_per_sec){
+#ifdef SO_MAX_PACING_RATE
+    return setsockopt(sfd, SOL_SOCKET, SO_MAX_PACING_RATE, &bytes_per_sec,
+        sizeof(bytes_per_sec)) == 0;
+#else
+    return 0;
+#endif
+}
+
+// CPU that processed the last packet received on the socket, -1 if unknown
+int GetIncomingCpu(int sfd){
+#ifdef SO_INCOMING_CPU
+    int cpu;
+    socklen_t len = sizeof(cpu);
+    if (getsockopt(sfd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == 0)
+        return cpu;
+#endif
+    return -1;
+}
+
 void SetBroadcast(int sfd){
 	int on = 1;
 	Setsockopt(sfd, SOL_SOCKET, SO_BROADCAST, &on, sizeof(on));
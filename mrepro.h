@@ -9,6 +9,9 @@
 #include <sys/wait.h>
 #include <sys/un.h>
 #include <sys/select.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 
 #include <arpa/inet.h>
 #include <assert.h>
@@ -18,6 +21,7 @@
 #include <netdb.h>
 
 #include <netinet/in.h>
+#include <netinet/tcp.h>        /* TCP_NODELAY, TCP_DEFER_ACCEPT */
 #include <netinet/in_systm.h>   /* network types */
 #include <netinet/ip.h>         /* struct ip */
 #include <netinet/ip_icmp.h>    /* struct icmp, icmphdr */
@@ -37,7 +41,7 @@
 
 // ===========================================================================
 
-int is_daemon;
+extern int is_daemon;
 
 typedef unsigned char byte;
 typedef void Sigfunc(int);
@@ -71,7 +75,7 @@ typedef void TCPFunc(int);
 
 #define BUFFER_LEN 8096
 #define BUFFER_LEN_SMALL 1024
-#define IP_LEN 50
+#define IP_LEN 50 // >= INET6_ADDRSTRLEN
 #define PORT_LEN 10
 #define BACKLOG 10
 
@@ -80,6 +84,7 @@ void Getnameinfo(const struct sockaddr*, socklen_t, char*, size_t, char*, size_t
 int Getpeername(int, struct sockaddr*, socklen_t*);
 void* In_addr(const struct sockaddr*);
 in_port_t In_port(const struct sockaddr*);
+int PassiveSocket(const char*, const char*, int);
 
 /*****************************************************************************
  *                                                                           *
@@ -89,6 +94,7 @@ in_port_t In_port(const struct sockaddr*);
 
 void* Malloc(size_t);
 void* Calloc(size_t);
+void* Realloc(void*, size_t);
 pid_t Fork();
 void Daemon(int,int);
 Sigfunc* signal(int, Sigfunc*);
@@ -106,6 +112,8 @@ void Error(const char*);
 int Socket(int, int, int);
 void Bind(int, const struct sockaddr*, socklen_t);
 void Close(int);
+ssize_t SendFds(int, const void*, size_t, const int*, int);
+ssize_t RecvFds(int, void*, size_t, int*, int*);
 
 /*****************************************************************************
  *                                                                           *
@@ -134,10 +142,15 @@ char* GetClientInfo(int, u_short*);
 void ReadStringUntil(int, char*, int, char);
 void WriteString(int, const char*, ...);
 void ReadFileFrom(int, const char*, const char*);
-void SendFile(int, int);
+ssize_t ReadToFile(int, int, off_t);
+ssize_t SendFile(int, int, off_t, size_t);
 void TransferFile(int, const char*, uint32_t);
 int TCPserver(const char*, int);
+int TCPserverOn(const char*, const char*, int);
+int UnixServer(const char*, int);
 int TCPclient(const char*, const char*);
+int TCPconnect(const char*, const char*);
+int UnixConnect(const char*);
 void TCPserverUsage(const char*);
 int RunTCPserver(int, char**, const char*,
     TCPFunc*, const char*, int);
@@ -155,6 +168,7 @@ ssize_t Sendto(int, const void*, size_t, int, const struct sockaddr*, socklen_t)
 ssize_t Recvfrom(int, void*, size_t, int, struct sockaddr*, socklen_t*);
 
 ssize_t Writen(int, const void*, size_t);
+ssize_t Writevn(int, struct iovec*, int);
 ssize_t Readn(int, void*, size_t);
 
 /*****************************************************************************
@@ -166,6 +180,13 @@ ssize_t Readn(int, void*, size_t);
 void Setsockopt(int, int, int, const void *, socklen_t);
 void SetTimeout(int, int, int);
 void SetReuseAddr(int);
+void SetNoDelay(int, int);
+void SetBufSize(int, int, int);
+void SetDeferAccept(int, int);
+void SetFastOpen(int, int);
+void SetNotSentLowat(int, int);
+int SetPacingRate(int, unsigned int);
+int GetIncomingCpu(int);
 void SetBroadcast(int);
 void SetTTL(int,int);
 
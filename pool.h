@@ -0,0 +1,161 @@
+#ifndef POOL_FH
+#define POOL_FH
+
+// Fixed size object pools for clients and I/O buffers.
+//
+// Objects are carved out of POOL_SLAB sized slabs and never go back to
+// malloc. Every thread keeps up to POOL_MAG free objects of each pool for
+// itself, so the common get/put pair takes no lock; the shared free list
+// is only touched to refill or spill half a magazine at a time, and when a
+// thread exits its magazines go back to the shared lists.
+// There is a shared list per NUMA node: a thread refills from and spills to
+// the one of the node it runs on, so objects stay where they were first
+// touched as long as threads stay put (-a). Clients are the exception:
+// main takes them and their own threads give them back, so per node lists
+// would fill up on nodes main never draws from; they keep a single list.
+
+#define POOL_SLAB  64   // objects per slab
+#define POOL_MAG   16   // objects a thread keeps per pool
+#define POOL_COUNT 3
+#define POOL_NODES 8    // more nodes share lists
+
+typedef struct pool_obj {
+    struct pool_obj* next;
+} pool_obj;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pool_obj* free;
+    long slabs;
+} pool_node;
+
+typedef struct {
+    int id;
+    size_t size;
+    int shared;     // one list for all nodes, in nodes[0]
+    pool_node nodes[POOL_NODES];
+} pool;
+
+// I/O buffers have room for a chunk header and trailer around BUFFER_LEN
+#define POOL_BUFFER_LEN (BUFFER_LEN + 32)
+
+#define POOL_NODES_INIT { [0 ... POOL_NODES - 1] = { PTHREAD_MUTEX_INITIALIZER, NULL, 0 } }
+
+pool client_pool = { 0, sizeof(client), 1, POOL_NODES_INIT };
+pool buffer_pool = { 1, POOL_BUFFER_LEN, 0, POOL_NODES_INIT };
+pool small_pool = { 2, BUFFER_LEN_SMALL, 0, POOL_NODES_INIT };
+pool* pools[POOL_COUNT] = { &client_pool, &buffer_pool, &small_pool };
+
+__thread pool_obj* pool_mag[POOL_COUNT];
+__thread int pool_mag_len[POOL_COUNT];
+__thread int pool_registered;
+__thread int pool_node_id = -1;
+pthread_key_t pool_key;
+pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+// shared lists of the node the calling thread runs on
+pool_node* PoolNode(pool* p){
+#ifdef SYS_getcpu
+    unsigned int cpu, node;
+#endif
+    if (p->shared)
+        return p->nodes;
+#ifdef SYS_getcpu
+    if (pool_node_id == -1)
+        pool_node_id = syscall(SYS_getcpu, &cpu, &node, NULL) == 0 ? node % POOL_NODES : 0;
+#else
+    pool_node_id = 0;
+#endif
+    return p->nodes + pool_node_id;
+}
+
+// hand count objects from the head of list back to p
+void PoolSpill(pool* p, pool_obj** list, int count){
+    pool_node* pn = PoolNode(p);
+    pool_obj* head = *list;
+    pool_obj* tail = head;
+    int i;
+
+    for (i = 1; i < count; i++)
+        tail = tail->next;
+    *list = tail->next;
+
+    pthread_mutex_lock(&pn->lock);
+    tail->next = pn->free;
+    pn->free = head;
+    pthread_mutex_unlock(&pn->lock);
+}
+
+// thread exit
+void PoolFlush(void* unused){
+    int i;
+    FOR(i, POOL_COUNT){
+        if (pool_mag_len[i] > 0)
+            PoolSpill(pools[i], &pool_mag[i], pool_mag_len[i]);
+        pool_mag_len[i] = 0;
+    }
+}
+
+void PoolKey(){
+    pthread_key_create(&pool_key, PoolFlush);
+}
+
+void* PoolGet(pool* p){
+    pool_node* pn;
+    pool_obj* obj;
+    byte* slab;
+    int i, id = p->id;
+
+    if (pool_mag_len[id] == 0){
+        pn = PoolNode(p);
+        pthread_mutex_lock(&pn->lock);
+        if (pn->free == NULL){
+            // first touch is here, on this thread's node
+            slab = Malloc(p->size * POOL_SLAB);
+            FOR(i, POOL_SLAB){
+                obj = (pool_obj*) (slab + i * p->size);
+                obj->next = pn->free;
+                pn->free = obj;
+            }
+            pn->slabs++;
+        }
+        // half a magazine
+        while (pn->free != NULL && pool_mag_len[id] < POOL_MAG / 2){
+            obj = pn->free;
+            pn->free = obj->next;
+            obj->next = pool_mag[id];
+            pool_mag[id] = obj;
+            pool_mag_len[id]++;
+        }
+        pthread_mutex_unlock(&pn->lock);
+    }
+
+    obj = pool_mag[id];
+    pool_mag[id] = obj->next;
+    pool_mag_len[id]--;
+    return obj;
+}
+
+void PoolPut(pool* p, void* ptr){
+    pool_obj* obj = ptr;
+    int id = p->id;
+
+    if (ptr == NULL)
+        return;
+
+    if (!pool_registered){
+        pthread_once(&pool_once, PoolKey);
+        pthread_setspecific(pool_key, &pool_registered); // PoolFlush() at exit
+        pool_registered = 1;
+    }
+
+    if (pool_mag_len[id] == POOL_MAG){
+        PoolSpill(p, &pool_mag[id], POOL_MAG / 2);
+        pool_mag_len[id] -= POOL_MAG / 2;
+    }
+    obj->next = pool_mag[id];
+    pool_mag[id] = obj;
+    pool_mag_len[id]++;
+}
+
+#endif // POOL_FH
@@ -0,0 +1,492 @@
+#ifndef PROXY_FH
+#define PROXY_FH
+
+// Reverse proxy.
+//
+// -p prefix=host:port sends every request whose target starts with prefix
+// to an HTTP/1.1 upstream, the longest matching prefix wins; unix:path
+// for an upstream on a unix socket. Upstream
+// connections are kept alive and reused; each upstream has a stack of idle
+// ones, the most recently used is taken first and checked with poll()
+// before it is trusted with a request. A failed connect marks the upstream
+// down for UPSTREAM_RETRY seconds, its requests get 502 right away instead
+// of every one of them waiting on connect() again.
+// Bodies are streamed both ways, never held whole: Content-Length bodies
+// are copied (spliced on plain sockets), chunked ones are re-chunked, and a
+// response delimited by the upstream closing goes out chunked.
+// The client's Host is passed on as is. HTTP/2 requests come as the HTTP/1.1
+// head H2RequestHead() makes of their fields, and the response fields go
+// back on the stream; either way without the hop by hop ones.
+
+#define UPSTREAM_IDLE       32  // idle connections kept per upstream
+#define UPSTREAM_IDLE_SECS  30  // older ones are closed rather than reused
+#define UPSTREAM_RETRY      5   // seconds a failed upstream is left alone
+#define UPSTREAM_TIMEOUT    60  // seconds to wait on upstream reads
+
+typedef struct upstream {
+    char* name;     // as given, for logs
+    char* host;
+    char* port;
+    char* path;     // unix socket instead of host and port
+    pthread_mutex_t lock;
+    int idle[UPSTREAM_IDLE];
+    time_t idle_since[UPSTREAM_IDLE];
+    int num_idle;
+    time_t down_until;
+    struct upstream* next;
+} upstream;
+
+typedef struct proxy_route {
+    char* prefix;
+    size_t len;
+    upstream* up;
+    struct proxy_route* next;   // longer prefixes first
+} proxy_route;
+
+proxy_route* proxy_routes = NULL;
+upstream* upstreams = NULL;
+
+// hop by hop headers, and the framing ones rewritten here
+const char* proxy_skip[] = { "Connection", "Keep-Alive", "Proxy-Connection", "TE",
+    "Trailer", "Transfer-Encoding", "Upgrade", "Expect", "HTTP2-Settings", 0 };
+
+// host:port, [v6]:port or unix:path; the same address shares its pool,
+// NULL if it is none of them
+upstream* UpstreamFind(const char* addr){
+    const char* colon = strrchr(addr, ':');
+    upstream* up;
+
+    for (up = upstreams; up != NULL; up = up->next)
+        if (!strcmp(up->name, addr))
+            return up;
+    if (colon == NULL || colon == addr || colon[1] == 0)
+        return NULL;
+
+    up = Calloc(sizeof(upstream));
+    up->name = strdup(addr);
+    if (!strncmp(addr, "unix:", 5))
+        up->path = strdup(addr + 5);
+    else {
+        up->host = strndup(addr, colon - addr);
+        up->port = strdup(colon + 1);
+        if (up->host[0] == '[' && up->host[strlen(up->host) - 1] == ']'){
+            up->host[strlen(up->host) - 1] = 0;
+            memmove(up->host, up->host + 1, strlen(up->host));
+        }
+    }
+    pthread_mutex_init(&up->lock, NULL);
+    up->next = upstreams;
+    upstreams = up;
+    return up;
+}
+
+// prefix=host:port
+void ProxyAdd(const char* spec){
+    const char* eq = strchr(spec, '=');
+    proxy_route* pr;
+    proxy_route** pp;
+    upstream* up;
+
+    if (eq == NULL || eq == spec || (up = UpstreamFind(eq + 1)) == NULL)
+        Errx(MP_PARAM_ERR, "proxy %s is not prefix=host:port", spec);
+
+    pr = MLC(proxy_route, 1);
+    pr->len = eq - spec;
+    pr->prefix = MLC(char, (pr->len + 1));
+    memcpy(pr->prefix, spec, pr->len);
+    pr->prefix[pr->len] = 0;
+    pr->up = up;
+
+    for (pp = &proxy_routes; *pp != NULL && (*pp)->len >= pr->len; pp = &(*pp)->next);
+    pr->next = *pp;
+    *pp = pr;
+}
+
+proxy_route* ProxyFind(const char* path){
+    proxy_route* pr;
+    for (pr = proxy_routes; pr != NULL; pr = pr->next)
+        if (!strncmp(path, pr->prefix, pr->len))
+            return pr;
+    return NULL;
+}
+
+// UPSTREAM CONNECTIONS
+
+// an idle connection is only good if the upstream hasn't closed it or sent
+// anything since, either shows up as readable
+int UpstreamAlive(int s){
+    struct pollfd pfd = { s, POLLIN, 0 };
+    return poll(&pfd, 1, 0) == 0;
+}
+
+// connection to up, *reused says if it served requests before; -1 when up
+// can't be reached
+int UpstreamGet(upstream* up, int* reused){
+    time_t now = time(NULL);
+    int s;
+
+    pthread_mutex_lock(&up->lock);
+    while (up->num_idle > 0){
+        s = up->idle[--up->num_idle];
+        if (now - up->idle_since[up->num_idle] <= UPSTREAM_IDLE_SECS && UpstreamAlive(s)){
+            pthread_mutex_unlock(&up->lock);
+            *reused = 1;
+            return s;
+        }
+        close(s);
+    }
+    if (now < up->down_until){
+        pthread_mutex_unlock(&up->lock);
+        errno = ECONNREFUSED;
+        return -1;
+    }
+    pthread_mutex_unlock(&up->lock);
+
+    *reused = 0;
+    if ( (s = up->path != NULL ? UnixConnect(up->path) : TCPconnect(up->host, up->port)) == -1 ){
+        Warnx("upstream %s: %s", up->name, strerror(errno));
+        pthread_mutex_lock(&up->lock);
+        up->down_until = time(NULL) + UPSTREAM_RETRY;
+        pthread_mutex_unlock(&up->lock);
+        return -1;
+    }
+    fcntl(s, F_SETFD, FD_CLOEXEC);
+    if (up->path == NULL)
+        SetNoDelay(s, 1);
+    SetTimeout(s, UPSTREAM_TIMEOUT, 0);
+    return s;
+}
+
+// back on the idle stack after a complete exchange
+void UpstreamPut(upstream* up, int s){
+    pthread_mutex_lock(&up->lock);
+    if (up->num_idle < UPSTREAM_IDLE){
+        up->idle_since[up->num_idle] = time(NULL);
+        up->idle[up->num_idle++] = s;
+        s = -1;
+    }
+    pthread_mutex_unlock(&up->lock);
+    if (s != -1)
+        close(s);
+}
+
+// REQUEST
+
+int ProxySkip(const char* line){
+    int i;
+    size_t len;
+    for (i = 0; proxy_skip[i]; i++){
+        len = strlen(proxy_skip[i]);
+        if (!strncasecmp(line, proxy_skip[i], len) && line[len] == ':')
+            return 1;
+    }
+    return 0;
+}
+
+// header lines of head (first line left out) up to end, the CRLF CRLF,
+// into out without the hop by hop ones, nor Content-Length when the body
+// goes on chunked; returns the length
+int ProxyCopyHeaders(char* out, const char* head, const char* end, int chunked){
+    const char* line = strstr(head, "\r\n");
+    const char* next;
+    int len = 0;
+
+    while (line != NULL && line < end){
+        line += 2;
+        next = strstr(line, "\r\n");
+        if (!ProxySkip(line) && !(chunked && !strncasecmp(line, "Content-Length:", 15))){
+            memcpy(out + len, line, next + 2 - line);
+            len += next + 2 - line;
+        }
+        line = next;
+    }
+    return len;
+}
+
+// request line and headers for the upstream into out, returns the length
+int ProxyRequestHead(client* c, char* out, const char* method, const char* path,
+    const char* request, const char* end, int chunked){
+
+    const char* target = path;
+    int len, target_len = strlen(path);
+
+    if (request != NULL){
+        // from the request line, path is cut at BUFFER_LEN_SMALL
+        target = request + strcspn(request, " ");
+        target += strspn(target, " ");
+        target_len = strcspn(target, " \r\n");
+    }
+
+    len = sprintf(out, "%s %.*s HTTP/1.1\r\n", method, target_len, target);
+    if (request != NULL)
+        len += ProxyCopyHeaders(out + len, request, end, chunked);
+    else if (c->host != NULL)
+        len += sprintf(out + len, "Host: %s\r\n", c->host);
+    if (chunked)
+        len += sprintf(out + len, "Transfer-Encoding: chunked\r\n");
+    len += sprintf(out + len, "X-Forwarded-For: %s\r\nX-Forwarded-Proto: %s\r\n\r\n",
+        c->ip, c->ssl != NULL ? "https" : "http");
+    return len;
+}
+
+// RESPONSE
+
+// reads the upstream's response header into r, interim 1xx ones are
+// dropped; returns its length, 0 if the upstream closed before a byte,
+// -1 on anything else
+int ProxyReadHead(body_reader* r){
+    char* end;
+    int n, len;
+
+    r->len = r->pos = 0;
+    for (;;){
+        r->buff[r->len] = 0;
+        if ( (end = strstr(r->buff, "\r\n\r\n")) != NULL ){
+            len = end + 4 - r->buff;
+            if (strncmp(r->buff, "HTTP/1.", 7) || r->len < 12)
+                return -1;
+            if (r->buff[9] != '1' || !strncmp(r->buff + 9, "101", 3)){
+                r->pos = len;
+                return len;
+            }
+            memmove(r->buff, r->buff + len, r->len - len);
+            r->len -= len;
+            continue;
+        }
+        // room for the rewritten header on the way out
+        if (r->len >= BUFFER_LEN - BUFFER_LEN_SMALL)
+            return -1;
+        if ( (n = Recv(r->from, r->buff + r->len, BUFFER_LEN - BUFFER_LEN_SMALL - r->len, 0)) <= 0 )
+            return n == 0 && r->len == 0 ? 0 : -1;
+        r->len += n;
+    }
+}
+
+// count body bytes, -1 for all until the upstream closes, to the client
+// through w if there is one; 0 when all of them made it
+int ProxyCopy(body_reader* r, client* c, body_writer* w, long long count){
+    long long n;
+
+    for (;;){
+        n = r->len - r->pos;
+        if (count >= 0)
+            n = MIN(n, count);
+        if (n > 0){
+            if (w != NULL)
+                BodyWrite(w, r->buff + r->pos, n);
+            else if (ClientWrite(c, r->buff + r->pos, n) < 0)
+                return -1;
+            if (w != NULL && w->failed)
+                return -1;
+            r->pos += n;
+            if (count > 0)
+                count -= n;
+        }
+        if (count == 0)
+            return 0;
+
+        // the rest straight from socket to socket where nothing is in between
+        if (w == NULL && count > 0 && c->stream == NULL && c->ssl == NULL && !Paced(c, count))
+            return ReadToFile(r->from, c->socket, count) == count ? 0 : -1;
+
+        if ( (r->len = BodyFill(r)) <= 0 )
+            return count < 0 && r->len == 0 ? 0 : -1;
+        r->pos = 0;
+    }
+}
+
+// chunked upstream body through w, 0 when all of it made it
+int ProxyChunked(body_reader* r, client* c, body_writer* w){
+    char line[BUFFER_LEN_SMALL];
+    long long size;
+    char* end;
+
+    for (;;){
+        if (BodyLine(r, line, sizeof(line)) < 0)
+            return -1;
+        size = strtoll(line, &end, 16);
+        if (end == line || size < 0)
+            return -1;
+        if (size == 0)
+            break;
+        if (ProxyCopy(r, c, w, size) || BodyLine(r, line, sizeof(line)) != 0)
+            return -1;
+    }
+    while ( (size = BodyLine(r, line, sizeof(line))) > 0 ); // trailers
+    return size == 0 ? 0 : -1;
+}
+
+// response head and body to the client; returns 1 if the upstream
+// connection can take another request, 0 if not, -1 if the client failed
+int ProxyRelay(client* c, body_reader* r, const char* method){
+    char* head = r->buff;
+    char* length = HeaderValue(head, "Content-Length");
+    char* encoding = HeaderValue(head, "Transfer-Encoding");
+    char* conn = HeaderValue(head, "Connection");
+    char* type = HeaderValue(head, "Content-Type");
+    char* out;
+    body_writer w;
+    int code = atoi(head + 9), len, ret;
+    int keep = !strncmp(head, "HTTP/1.1", 8) && (conn == NULL || strcasestr(conn, "close") == NULL);
+    int chunked = encoding != NULL;
+    long long size = length != NULL && !chunked ? ContentLength(length) : -1;
+    int bodyless = !strcasecmp(method, "HEAD") || code == 204 || code == 304;
+
+    if (length != NULL && !chunked && size < 0){
+        // no telling where its body ends, nor its next answer starts
+        free(length);
+        free(encoding);
+        free(conn);
+        free(type);
+        HttpError(c, 502);
+        return 0;
+    }
+    if (c->stream != NULL){
+        TraceFirstByte(&c->trace, c->socket, code);
+        H2WriteHeader(c->stream, code, size <= INT_MAX ? size : -1, type, NULL, strstr(head, "\r\n") + 2);
+        Log("%s <- [%d] proxy h2\n", c->ip, code);
+    } else {
+        out = PoolGet(&buffer_pool);
+        len = sprintf(out, "HTTP/1.1 %.*s\r\n", (int) strcspn(head + 9, "\r\n"), head + 9);
+        len += ProxyCopyHeaders(out + len, head, strstr(head, "\r\n\r\n"), size < 0);
+        if (size < 0 && !bodyless)
+            len += sprintf(out + len, "Transfer-Encoding: chunked\r\n");
+        if (draining)
+            len += sprintf(out + len, "Connection: close\r\n");
+        len += sprintf(out + len, "\r\n");
+        ret = ClientWrite(c, out, len);
+        PoolPut(&buffer_pool, out);
+        TraceFirstByte(&c->trace, c->socket, code);
+        Log("%s <- [%d] proxy\n", c->ip, code);
+        if (ret < 0)
+            code = -1;
+    }
+
+    free(length);
+    free(encoding);
+    free(conn);
+    free(type);
+
+    if (code == -1)
+        return -1;
+    if (bodyless)
+        return keep;
+    if (size >= 0)
+        return ProxyCopy(r, c, NULL, size) ? -1 : keep;
+
+    // chunked, or up to the upstream's close
+    BodyInit(&w, c);
+    ret = chunked ? ProxyChunked(r, c, &w) : ProxyCopy(r, c, &w, -1);
+    if (BodyEnd(&w) || ret)
+        return -1;
+    return chunked && keep;
+}
+
+// request to route's upstream and the answer back; request is the head,
+// on HTTP/2 the one H2RequestHead() made. Returns 0 when the client connection can't carry on.
+int Proxy(client* c, proxy_route* pr, const char* method, const char* request, int req_len, const char* path){
+    const char* end = request != NULL ? strstr(request, "\r\n\r\n") : NULL;
+    char* length = request != NULL ? HeaderValue(request, "Content-Length") : NULL;
+    char* encoding = request != NULL ? HeaderValue(request, "Transfer-Encoding") : NULL;
+    char* expect = request != NULL ? HeaderValue(request, "Expect") : NULL;
+    const char* cont = "HTTP/1.1 100 Continue\r\n\r\n";
+    int chunked = encoding != NULL && strlen(encoding) >= 7 &&
+        !strcasecmp(encoding + strlen(encoding) - 7, "chunked");
+    long long size = length != NULL ? ContentLength(length) : 0;
+    int has_body = chunked || size > 0;
+    int s = -1, reused = 0, tries, len = 0, ret, code = 0;
+    body_reader q, r;
+    char* out = NULL;
+
+    Log("%s -> %s %s proxy %s\n", c->ip, method, path, pr->up->name);
+
+    if (!LimitRequest(c))
+        code = 429;
+    else if (request != NULL && end == NULL)
+        code = 400;
+    else if (encoding != NULL && !chunked)
+        code = 501;
+    else if (size < 0 || (chunked && length != NULL))
+        code = 400;     // both framings is how requests get smuggled
+    else if ((request != NULL ? end - request : strlen(path) + (c->host != NULL ? strlen(c->host) : 0)) +
+             BUFFER_LEN_SMALL > BUFFER_LEN)
+        code = 431;
+
+    q.c = r.c = c;
+    q.from = -1;
+    q.buff = r.buff = NULL;
+
+    // a reused connection may have been closed under us, one more try on a
+    // fresh one is safe as long as no body went out
+    for (tries = 0; code == 0 && tries < 2; tries++){
+        if ( (s = UpstreamGet(pr->up, &reused)) == -1 ){
+            code = 502;
+            break;
+        }
+        TraceMark(&c->trace, TRACE_OPEN);
+        if (out == NULL){
+            out = PoolGet(&buffer_pool);
+            len = ProxyRequestHead(c, out, method, path, request, end, chunked);
+        }
+        if (Writen(s, out, len) < 0){
+            close(s);
+            s = -1;
+            if (reused && !has_body)
+                continue;
+            code = 502;
+            break;
+        }
+
+        if (has_body){
+            if (expect != NULL && !strcasecmp(expect, "100-continue"))
+                ClientWrite(c, cont, strlen(cont));
+            q.buff = PoolGet(&buffer_pool);
+            q.len = request + req_len - (end + 4);
+            q.pos = 0;
+            memcpy(q.buff, end + 4, q.len);
+            if ( (chunked ? BodyChunked(&q, s, LLONG_MAX, 1) : BodyCopy(&q, s, size)) ){
+                code = 502;
+                break;
+            }
+        }
+
+        r.from = s;
+        if (r.buff == NULL)
+            r.buff = PoolGet(&buffer_pool);
+        if ( (ret = ProxyReadHead(&r)) > 0 )
+            break;
+        code = errno == EAGAIN || errno == EWOULDBLOCK ? 504 : 502;
+        close(s);
+        s = -1;
+        if (ret == 0 && reused && !has_body){
+            code = 0;
+            continue;
+        }
+        break;
+    }
+
+    free(length);
+    free(encoding);
+    free(expect);
+    PoolPut(&buffer_pool, out);
+    PoolPut(&buffer_pool, q.buff);
+
+    if (code != 0){
+        if (s != -1)
+            close(s);
+        PoolPut(&buffer_pool, r.buff);
+        // a request body may still be on the wire
+        HttpErrorConn(c, code, has_body);
+        return !has_body;
+    }
+
+    ret = ProxyRelay(c, &r, method);
+    PoolPut(&buffer_pool, r.buff);
+    if (ret == 1)
+        UpstreamPut(pr->up, s);
+    else
+        close(s);
+    return ret >= 0 && !draining;
+}
+
+#endif // PROXY_FH
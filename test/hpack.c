@@ -0,0 +1,175 @@
+// HPACK decoder against the examples of RFC 7541 appendix C.
+//
+// Each example is decoded into an h2_stream, as a request's header block
+// would be, and the fields that came out and the dynamic table after it
+// are compared with the RFC. An example continues the table of the one
+// before it, until the next C.x.1. A few broken blocks after them must be
+// refused. The server itself is compiled in, main() excluded.
+//
+//   make test
+
+#define _GNU_SOURCE
+#define MOJWEB_NO_MAIN
+#include "../mojweb.c"
+
+typedef struct {
+    const char* name;
+    size_t max_size;        // a new table, 0 goes on with the last one
+    const char* block;      // hex, spaces ignored
+    const char* method;
+    const char* path;
+    const char* authority;
+    const char* fields;
+    const char* table[5];   // "name: value", newest first
+    size_t size;
+    int refused;            // the block is an error
+} hpack_case;
+
+#define DATE1 "date: Mon, 21 Oct 2013 20:13:21 GMT"
+#define DATE2 "date: Mon, 21 Oct 2013 20:13:22 GMT"
+#define COOKIE "set-cookie: foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1"
+#define LOCATION "location: https://www.example.com"
+
+hpack_case cases[] = {
+    // requests without Huffman coding
+    { "C.3.1", 4096, "8286 8441 0f77 7777 2e65 7861 6d70 6c65 2e63 6f6d",
+      "GET", "/", "www.example.com", NULL,
+      { ":authority: www.example.com" }, 57 },
+    { "C.3.2", 0, "8286 84be 5808 6e6f 2d63 6163 6865",
+      "GET", "/", "www.example.com", "cache-control: no-cache\r\n",
+      { "cache-control: no-cache", ":authority: www.example.com" }, 110 },
+    { "C.3.3", 0, "8287 85bf 400a 6375 7374 6f6d 2d6b 6579 0c63 7573 746f 6d2d 7661 6c75 65",
+      "GET", "/index.html", "www.example.com", "custom-key: custom-value\r\n",
+      { "custom-key: custom-value", "cache-control: no-cache", ":authority: www.example.com" }, 164 },
+
+    // requests with Huffman coding
+    { "C.4.1", 4096, "8286 8441 8cf1 e3c2 e5f2 3a6b a0ab 90f4 ff",
+      "GET", "/", "www.example.com", NULL,
+      { ":authority: www.example.com" }, 57 },
+    { "C.4.2", 0, "8286 84be 5886 a8eb 1064 9cbf",
+      "GET", "/", "www.example.com", "cache-control: no-cache\r\n",
+      { "cache-control: no-cache", ":authority: www.example.com" }, 110 },
+    { "C.4.3", 0, "8287 85bf 4088 25a8 49e9 5ba9 7d7f 8925 a849 e95b b8e8 b4bf",
+      "GET", "/index.html", "www.example.com", "custom-key: custom-value\r\n",
+      { "custom-key: custom-value", "cache-control: no-cache", ":authority: www.example.com" }, 164 },
+
+    // responses without Huffman coding, a 256 byte table that evicts
+    { "C.5.1", 256, "4803 3330 3258 0770 7269 7661 7465 611d 4d6f 6e2c 2032 3120"
+      "4f63 7420 3230 3133 2032 303a 3133 3a32 3120 474d 546e 1768 7474 7073 3a2f"
+      "2f77 7777 2e65 7861 6d70 6c65 2e63 6f6d",
+      NULL, NULL, NULL, "cache-control: private\r\n" DATE1 "\r\n" LOCATION "\r\n",
+      { LOCATION, DATE1, "cache-control: private", ":status: 302" }, 222 },
+    { "C.5.2", 0, "4803 3330 37c1 c0bf",
+      NULL, NULL, NULL, "cache-control: private\r\n" DATE1 "\r\n" LOCATION "\r\n",
+      { ":status: 307", LOCATION, DATE1, "cache-control: private" }, 222 },
+    { "C.5.3", 0, "88c1 611d 4d6f 6e2c 2032 3120 4f63 7420 3230 3133 2032 303a 3133"
+      "3a32 3220 474d 54c0 5a04 677a 6970 7738 666f 6f3d 4153 444a 4b48 514b 425a"
+      "584f 5157 454f 5049 5541 5851 5745 4f49 553b 206d 6178 2d61 6765 3d33 3630"
+      "303b 2076 6572 7369 6f6e 3d31",
+      NULL, NULL, NULL, "cache-control: private\r\n" DATE2 "\r\n" LOCATION "\r\n"
+      "content-encoding: gzip\r\n" COOKIE "\r\n",
+      { COOKIE, "content-encoding: gzip", DATE2 }, 215 },
+
+    // responses with Huffman coding
+    { "C.6.1", 256, "4882 6402 5885 aec3 771a 4b61 96d0 7abe 9410 54d4 44a8 2005"
+      "9504 0b81 66e0 82a6 2d1b ff6e 919d 29ad 1718 63c7 8f0b 97c8 e9ae 82ae 43d3",
+      NULL, NULL, NULL, "cache-control: private\r\n" DATE1 "\r\n" LOCATION "\r\n",
+      { LOCATION, DATE1, "cache-control: private", ":status: 302" }, 222 },
+    { "C.6.2", 0, "4883 640e ffc1 c0bf",
+      NULL, NULL, NULL, "cache-control: private\r\n" DATE1 "\r\n" LOCATION "\r\n",
+      { ":status: 307", LOCATION, DATE1, "cache-control: private" }, 222 },
+    { "C.6.3", 0, "88c1 6196 d07a be94 1054 d444 a820 0595 040b 8166 e084 a62d 1bff"
+      "c05a 839b d9ab 77ad 94e7 821d d7f2 e6c7 b335 dfdf cd5b 3960 d5af 2708 7f36"
+      "72c1 ab27 0fb5 291f 9587 3160 65c0 03ed 4ee5 b106 3d50 07",
+      NULL, NULL, NULL, "cache-control: private\r\n" DATE2 "\r\n" LOCATION "\r\n"
+      "content-encoding: gzip\r\n" COOKIE "\r\n",
+      { COOKIE, "content-encoding: gzip", DATE2 }, 215 },
+
+    // Huffman padding that isn't a prefix of EOS: not all ones, or 8 bits
+    { "padding 0", 4096, "8286 8441 8cf1 e3c2 e5f2 3a6b a0ab 90f4 fe",
+      NULL, NULL, NULL, NULL, { NULL }, 0, 1 },
+    { "padding 8", 4096, "8286 8441 8df1 e3c2 e5f2 3a6b a0ab 90f4 ffff",
+      NULL, NULL, NULL, NULL, { NULL }, 0, 1 },
+
+    { 0 }
+};
+
+size_t Unhex(const char* hex, byte* out){
+    size_t len = 0;
+    unsigned int b;
+
+    for ( ; *hex; hex++ ){
+        if (*hex == ' ')
+            continue;
+        sscanf(hex++, "%2x", &b);
+        out[len++] = b;
+    }
+    return len;
+}
+
+int Same(const hpack_case* k, const char* what, const char* got, const char* want){
+    if ( (got == NULL) != (want == NULL) || (got != NULL && strcmp(got, want)) ){
+        printf("%s: %s is \"%s\", expected \"%s\"\n", k->name, what,
+            got != NULL ? got : "(none)", want != NULL ? want : "(none)");
+        return 0;
+    }
+    return 1;
+}
+
+int Check(const hpack_case* k, hpack_table* t){
+    byte block[BUFFER_LEN];
+    char entry[BUFFER_LEN], what[32];
+    h2_stream st;
+    size_t len = Unhex(k->block, block);
+    int i, ok;
+
+    memset(&st, 0, sizeof(st));
+    if ( (ok = !HpackDecode(t, block, len, &st)) == k->refused ){
+        printf(ok ? "%s: decoded, expected an error\n" : "%s: not decoded\n", k->name);
+        ok = 0;
+    } else if (k->refused)
+        ok = 1;
+    else {
+        ok = Same(k, "method", st.method, k->method) &
+             Same(k, "path", st.path, k->path) &
+             Same(k, "authority", st.authority, k->authority) &
+             Same(k, "fields", st.fields, k->fields);
+        for ( i = 0; i < t->count || k->table[i] != NULL; i++ ){
+            if (i < t->count)
+                snprintf(entry, sizeof(entry), "%s: %s", t->entries[i].name, t->entries[i].value);
+            sprintf(what, "table[%d]", i + 1);
+            ok &= Same(k, what, i < t->count ? entry : NULL, k->table[i]);
+        }
+        if (t->size != k->size){
+            printf("%s: table size is %zu, expected %zu\n", k->name, t->size, k->size);
+            ok = 0;
+        }
+    }
+
+    free(st.method);
+    free(st.path);
+    free(st.authority);
+    free(st.fields);
+    return ok;
+}
+
+int main(){
+    hpack_table t;
+    int i, failed = 0;
+
+    memset(&t, 0, sizeof(t));
+    for ( i = 0; cases[i].name; i++ ){
+        if (cases[i].max_size){
+            HpackEvict(&t, t.max_size);
+            t.max_size = cases[i].max_size;
+        }
+        if (Check(&cases[i], &t))
+            printf("%s ok\n", cases[i].name);
+        else
+            failed++;
+    }
+    HpackEvict(&t, t.max_size);
+
+    printf("%d of %d failed\n", failed, i);
+    return failed != 0;
+}
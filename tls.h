@@ -0,0 +1,146 @@
+#ifndef TLS_FH
+#define TLS_FH
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#define TLS_SESSION_ID "mojweb" // session cache is per server context
+
+SSL_CTX* tls_ctx = NULL;
+
+// ALPN, in order of preference
+const byte tls_alpn[] = "\x02h2\x08http/1.1";
+
+void TlsError(const char* what){
+    char buff[256];
+    ERR_error_string_n(ERR_get_error(), buff, sizeof(buff));
+    Warnx("%s: %s", what, buff);
+}
+
+int TlsAlpnSelect(SSL* ssl, const byte** out, byte* outlen,
+                  const byte* in, unsigned int inlen, void* arg){
+    if (SSL_select_next_proto((byte**) out, outlen, tls_alpn, sizeof(tls_alpn) - 1,
+            in, inlen) != OPENSSL_NPN_NEGOTIATED)
+        return SSL_TLSEXT_ERR_NOACK; // no overlap, plain http/1.1
+    return SSL_TLSEXT_ERR_OK;
+}
+
+int TlsIsH2(SSL* ssl){
+    const byte* proto;
+    unsigned int len;
+    SSL_get0_alpn_selected(ssl, &proto, &len);
+    return len == 2 && !memcmp(proto, "h2", 2);
+}
+
+void TlsInit(const char* cert, const char* key){
+    tls_ctx = SSL_CTX_new(TLS_server_method());
+    if (tls_ctx == NULL){
+        TlsError("SSL_CTX_new");
+        Errx(MP_RUNT_ERR, "can't create TLS context");
+    }
+
+    SSL_CTX_set_min_proto_version(tls_ctx, TLS1_2_VERSION);
+
+    if (SSL_CTX_use_certificate_chain_file(tls_ctx, cert) != 1){
+        TlsError(cert);
+        Errx(MP_PARAM_ERR, "can't load certificate %s", cert);
+    }
+    if (SSL_CTX_use_PrivateKey_file(tls_ctx, key, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(tls_ctx) != 1){
+        TlsError(key);
+        Errx(MP_PARAM_ERR, "can't load private key %s", key);
+    }
+
+    // resumption: server side session cache for TLS 1.2 ids,
+    // tickets (on by default) for everything else
+    SSL_CTX_set_session_cache_mode(tls_ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_set_session_id_context(tls_ctx, (const byte*) TLS_SESSION_ID,
+        strlen(TLS_SESSION_ID));
+
+    SSL_CTX_set_alpn_select_cb(tls_ctx, TlsAlpnSelect, NULL);
+
+#ifdef SSL_OP_ENABLE_KTLS
+    // record layer moves to the kernel after the handshake when it can,
+    // then SSL_sendfile() is a real sendfile()
+    SSL_CTX_set_options(tls_ctx, SSL_OP_ENABLE_KTLS);
+#endif
+}
+
+// returns NULL if the handshake failed
+SSL* TlsAccept(int socket){
+    SSL* ssl = SSL_new(tls_ctx);
+
+    if (ssl == NULL){
+        TlsError("SSL_new");
+        return NULL;
+    }
+
+    SSL_set_fd(ssl, socket);
+    if (SSL_accept(ssl) != 1){
+        TlsError("SSL_accept");
+        SSL_free(ssl);
+        return NULL;
+    }
+
+    return ssl;
+}
+
+int TlsKernelSend(SSL* ssl){
+#ifndef OPENSSL_NO_KTLS
+    return BIO_get_ktls_send(SSL_get_wbio(ssl));
+#else
+    return 0;
+#endif
+}
+
+ssize_t TlsRead(SSL* ssl, void* buff, size_t len){
+    int n = SSL_read(ssl, buff, len);
+
+    if (n > 0)
+        return n;
+
+    switch (SSL_get_error(ssl, n)) {
+        case SSL_ERROR_ZERO_RETURN:
+            return 0;
+        case SSL_ERROR_SYSCALL:
+            if (errno == 0) return 0; // peer went away without close_notify
+            return -1;
+        default:
+            errno = EIO;
+            return -1;
+    }
+}
+
+ssize_t TlsWriten(SSL* ssl, const void* buff, size_t n){
+    size_t written;
+
+    if (n == 0)
+        return 0;
+    if (SSL_write_ex(ssl, buff, n, &written) != 1){
+        errno = EIO;
+        return -1;
+    }
+    return n; // without partial writes SSL_write_ex sends everything
+}
+
+// kTLS only, returns -1 without it
+ssize_t TlsSendFile(SSL* ssl, int fd, off_t offset, size_t count){
+#ifndef OPENSSL_NO_KTLS
+    ssize_t sent, total = 0;
+    while (total < count){
+        sent = SSL_sendfile(ssl, fd, offset + total, count - total, 0);
+        if (sent <= 0) return total ? total : -1;
+        total += sent;
+    }
+    return total;
+#else
+    return -1;
+#endif
+}
+
+void TlsClose(SSL* ssl){
+    SSL_shutdown(ssl);
+    SSL_free(ssl);
+}
+
+#endif // TLS_FH
@@ -0,0 +1,153 @@
+#ifndef TRACE_FH
+#define TRACE_FH
+
+#include <time.h>
+#include <stdint.h>
+
+// Request tracing.
+//
+// Static probes of the mojweb provider, for bpftrace, perf or systemtap to
+// attach to without a rebuild; they are a nop until something does, and
+// compile to nothing where there is no sys/sdt.h.
+//
+//   accept(fd, ip)                 connection taken
+//   parsed(fd, method, path)       request line and headers read
+//   open(fd, path)                 file or bundle member found
+//   first_byte(fd, status)         response header written
+//   done(fd, status)               last byte of the response written
+//
+// -t N times the phases of every Nth request in process: until it is
+// parsed, until its file (or upstream connection) is open, until the first
+// response byte and until the last one. A sampled request logs one line
+// with them and goes into a ring of the last TRACE_RING; SIGUSR1 logs
+// percentiles of every phase over the ring, so a slow tail can be put on
+// parsing, the filesystem or the network.
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TRACE_SDT
+#endif
+#endif
+
+#ifdef TRACE_SDT
+#define PROBE2(name, a, b)      DTRACE_PROBE2(mojweb, name, a, b)
+#define PROBE3(name, a, b, c)   DTRACE_PROBE3(mojweb, name, a, b, c)
+#else
+#define PROBE2(name, a, b)
+#define PROBE3(name, a, b, c)
+#endif
+
+#define TRACE_START  0
+#define TRACE_PARSED 1
+#define TRACE_OPEN   2
+#define TRACE_FIRST  3
+#define TRACE_DONE   4
+#define TRACE_MARKS  5
+#define TRACE_RING   4096
+
+// marks of the request in progress, ns; 0 is not reached
+typedef struct {
+    int on;         // sampled
+    int status;
+    int64_t at[TRACE_MARKS];
+} request_trace;
+
+// one sampled request, microseconds per phase
+typedef struct {
+    int parse, fs, first, send, total;
+} trace_record;
+
+int trace_every = 0;        // -t, 0 is off
+unsigned int trace_count = 0;
+trace_record trace_ring[TRACE_RING];
+unsigned int trace_next = 0;
+pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int64_t TraceNow(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// request bytes are in, decides if this one is sampled
+void TraceStart(request_trace* t){
+    t->on = trace_every > 0 && __sync_fetch_and_add(&trace_count, 1) % trace_every == 0;
+    t->status = 0;
+    if (t->on){
+        memset(t->at, 0, sizeof(t->at));
+        t->at[TRACE_START] = TraceNow();
+    }
+}
+
+void TraceMark(request_trace* t, int mark){
+    if (t->on && t->at[mark] == 0)
+        t->at[mark] = TraceNow();
+}
+
+// a response header is going out
+void TraceFirstByte(request_trace* t, int fd, int status){
+    PROBE2(first_byte, fd, status);
+    t->status = status;
+    TraceMark(t, TRACE_FIRST);
+}
+
+// from mark a to mark b in us, marks not reached take the one before
+int TraceSpan(const int64_t* at, int a, int b){
+    while (a > 0 && at[a] == 0) a--;
+    while (b > a && at[b] == 0) b--;
+    return (at[b] - at[a]) / 1000;
+}
+
+void TraceEnd(request_trace* t, int fd, const char* ip, const char* method, const char* path){
+    trace_record r;
+
+    PROBE2(done, fd, t->status);
+    if (!t->on)
+        return;
+    t->at[TRACE_DONE] = TraceNow();
+    r.parse = TraceSpan(t->at, TRACE_START, TRACE_PARSED);
+    r.fs = t->at[TRACE_OPEN] ? TraceSpan(t->at, TRACE_PARSED, TRACE_OPEN) : 0;
+    r.first = TraceSpan(t->at, TRACE_OPEN, TRACE_FIRST);
+    r.send = TraceSpan(t->at, TRACE_FIRST, TRACE_DONE);
+    r.total = TraceSpan(t->at, TRACE_START, TRACE_DONE);
+
+    Log("%s [%d] %s %s parse %d fs %d first %d send %d total %d us\n", ip, t->status,
+        method, path, r.parse, r.fs, r.first, r.send, r.total);
+
+    pthread_mutex_lock(&trace_lock);
+    trace_ring[trace_next++ % TRACE_RING] = r;
+    pthread_mutex_unlock(&trace_lock);
+}
+
+int TraceCompare(const void* a, const void* b){
+    return *(const int*) a - *(const int*) b;
+}
+
+// SIGUSR1: percentiles per phase over the ring
+void TraceDump(){
+    static const char* names[] = { "parse", "fs", "first", "send", "total" };
+    int* values = MLC(int, TRACE_RING);
+    trace_record* ring = MLC(trace_record, TRACE_RING);
+    int i, p, n;
+
+    pthread_mutex_lock(&trace_lock);
+    n = MIN(trace_next, TRACE_RING);
+    memcpy(ring, trace_ring, n * sizeof(trace_record));
+    pthread_mutex_unlock(&trace_lock);
+
+    Log("Trace: %d sampled requests, us\n", n);
+    FOR(p, 5){
+        if (n == 0)
+            break;
+        FOR(i, n)
+            values[i] = ((int*) (ring + i))[p];
+        qsort(values, n, sizeof(int), TraceCompare);
+        Log("  %-6s p50 %d  p90 %d  p99 %d  max %d\n", names[p], values[n / 2],
+            values[n * 9 / 10], values[n * 99 / 100], values[n - 1]);
+    }
+    free(values);
+    free(ring);
+}
+
+#endif // TRACE_FH